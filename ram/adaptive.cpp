@@ -0,0 +1,221 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <gmp.h>
+#include "adaptive.h"
+
+/* The first profile_steps steps run one at a time through
+   ram_do_instruction, counting the opcode mix, the operand kinds and
+   the size of the accumulator, with the memory access hook counting
+   register lookups and how many the cache node answered.  Then the
+   configuration is chosen once and the rest of the run goes through
+   ram_run:
+
+   - the native code, when the program has it;
+   - the B+-tree index, when memory is split into many segments and
+     the cache node misses most lookups;
+   - compaction, when those segments are mostly close together;
+   - no operand cache, when it misses most pointer operands anyway.
+
+   None of these change results, only where registers live and how
+   they are found.  Memory is not sampled if another hook (perf, the
+   heatmap) is attached; the index is then chosen by segment count. */
+
+static const unsigned int INDEX_SEGMENTS = 64, COMPACT_SEGMENTS = 256;
+
+static void memory_access (void *data, RAM_Memory *, unsigned long, int,
+				int hit)
+{
+   RAM_RuntimeProfile *p = (RAM_RuntimeProfile *) data;
+
+   (p -> lookups) ++;
+   (p -> cache_hits) += hit;
+}
+
+RAM_Adaptive *ram_adaptive_new (unsigned long profile_steps)
+{
+   RAM_Adaptive *ad;
+
+   ad = (RAM_Adaptive *) calloc (1, sizeof (RAM_Adaptive));
+   if (!ad)
+      err_fatal_perror ("calloc", "could not allocate RAM_Adaptive structure");
+
+   (ad -> profile_steps) = profile_steps ? profile_steps : 1UL << 16;
+
+   (ad -> hooks).access = memory_access;
+   (ad -> hooks).data = &(ad -> profile);
+
+   return ad;
+}
+
+void ram_adaptive_delete (RAM_Adaptive *ad)
+{
+   free (ad);
+}
+
+static unsigned long profile_run (RAM_Adaptive *ad, RAM *machine,
+				unsigned long steps)
+{
+   RAM_RuntimeProfile *p = &(ad -> profile);
+   RAM_Memory *memory = (machine -> memory);
+   unsigned long done = 0;
+   int hooked = !(memory -> hooks);
+
+   if (hooked)
+   {
+      (memory -> hooks) = &(ad -> hooks);
+      (p -> memory_sampled) = 1;
+   }
+
+   while (done < steps && (p -> steps) < (ad -> profile_steps) &&
+	  ram_is_running (machine))
+   {
+      RAM_Instruction *i;
+      unsigned long before = mpz_get_ui (machine -> instructions_done);
+      size_t limbs;
+
+      i = (machine -> program -> instructions)
+	      [machine -> current_instruction];
+
+      ram_do_instruction (machine);
+      if (mpz_get_ui (machine -> instructions_done) == before)
+	 break;
+
+      (p -> opcodes) [i -> instruction] ++;
+      if ((i -> parameter_type) == RAM_POINTER)
+	 (p -> pointer_operands) ++;
+      else if ((i -> parameter_type) == RAM_INDIRECT_POINTER)
+	 (p -> indirect_operands) ++;
+
+      limbs = mpz_size (*ram_accumulator (machine));
+      if (limbs > 1)
+	 (p -> wide_steps) ++;
+      if (limbs > (p -> max_limbs))
+	 (p -> max_limbs) = limbs;
+
+      (p -> steps) ++;
+      done ++;
+   }
+
+   if (hooked)
+      (memory -> hooks) = NULL;
+
+   return done;
+}
+
+/* The mean gap between neighbouring segments, over those keyed by
+   native words. */
+static unsigned long mean_gap (RAM_Memory *memory)
+{
+   RAM_AVL_Node *node, *next;
+   unsigned long gaps = 0, n = 0;
+
+   for (node = ram_memory_first_segment (memory); node; node = next)
+   {
+      next = ram_memory_next_segment (node);
+      if (next && !(node -> wide) && !(next -> wide))
+      {
+	 gaps += (next -> first) - (node -> last) - 1;
+	 n ++;
+      }
+   }
+
+   return n ? gaps / n : 0;
+}
+
+static void decide (RAM_Adaptive *ad, RAM *machine)
+{
+   RAM_RuntimeProfile *p = &(ad -> profile);
+   RAM_Memory *memory = (machine -> memory);
+   unsigned long uses;
+   int scattered;
+
+   (ad -> decided) = 1;
+   (ad -> segments) = (memory -> segment_count);
+   (ad -> native) = (machine -> program -> native) != NULL;
+
+   scattered = !(p -> memory_sampled) ||
+	   2 * (p -> cache_hits) < (p -> lookups);
+
+   if ((memory -> segment_count) >= INDEX_SEGMENTS && scattered)
+      ram_memory_set_segment_index (memory, RAM_INDEX_BTREE);
+   (ad -> index) = (memory -> index) ? RAM_INDEX_BTREE : RAM_INDEX_AVL;
+
+   (ad -> compaction) = !(memory -> compact_at) &&
+	   (memory -> segment_count) >= COMPACT_SEGMENTS &&
+	   mean_gap (memory) <= 2 * (memory -> block_size);
+   if (ad -> compaction)
+      ram_memory_set_compaction (memory, 2 * (memory -> segment_count),
+		      2 * (memory -> block_size));
+
+   /* With the operand cache a pointer operand reaches ram_get_register
+      only on a miss, an indirect one twice. */
+   uses = (p -> pointer_operands) + 2 * (p -> indirect_operands);
+   (ad -> operand_cache) = (machine -> operands) != NULL;
+   if ((ad -> operand_cache) && (p -> memory_sampled) && uses &&
+       4 * (p -> lookups) > 3 * uses)
+   {
+      free (machine -> operands);
+      (machine -> operands) = NULL;
+      (ad -> operand_cache) = 0;
+   }
+}
+
+unsigned long ram_adaptive_run (RAM_Adaptive *ad, RAM *machine,
+				unsigned long steps)
+{
+   unsigned long done = 0;
+
+   if (!(ad -> decided))
+   {
+      done = profile_run (ad, machine, steps);
+
+      if ((ad -> profile.steps) < (ad -> profile_steps))
+	 return done;
+
+      decide (ad, machine);
+   }
+
+   if (done < steps)
+      done += ram_run (machine, steps - done);
+
+   return done;
+}
+
+void ram_adaptive_report (RAM_Adaptive *ad, FILE *out)
+{
+   RAM_RuntimeProfile *p = &(ad -> profile);
+   unsigned int k;
+
+   fprintf (out, "adaptive: profiled %lu steps:", (p -> steps));
+   for (k = RAM_READ; k <= RAM_HALT; k ++)
+      if ((p -> opcodes) [k])
+	 fprintf (out, "  %s %.1f%%", ram_instruction_names [k],
+			 100.0 * (p -> opcodes) [k] / (p -> steps));
+   fprintf (out, "\n");
+
+   fprintf (out, "operands: %lu pointer, %lu indirect; ",
+		   (p -> pointer_operands), (p -> indirect_operands));
+   if (p -> memory_sampled)
+      fprintf (out, "%lu lookups, cache node hit %.1f%%\n", (p -> lookups),
+		      (p -> lookups) ?
+		      100.0 * (p -> cache_hits) / (p -> lookups) : 0.0);
+   else
+      fprintf (out, "memory not sampled\n");
+
+   fprintf (out, "accumulator: %lu steps wider than a limb, at most %lu "
+		   "limbs\n", (p -> wide_steps), (unsigned long) (p -> max_limbs));
+
+   if (!(ad -> decided))
+   {
+      fprintf (out, "configuration not chosen yet\n");
+      return;
+   }
+
+   fprintf (out, "chose: %s, %s index over %u segments, compaction %s, "
+		   "operand cache %s\n",
+		   (ad -> native) ? "native code" : "interpreter",
+		   (ad -> index) == RAM_INDEX_BTREE ? "B+-tree" : "AVL",
+		   (ad -> segments), (ad -> compaction) ? "on" : "off",
+		   (ad -> operand_cache) ? "on" : "off");
+}
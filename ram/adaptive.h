@@ -0,0 +1,42 @@
+#ifndef RAM_ADAPTIVE_H
+#define RAM_ADAPTIVE_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "ram.h"
+
+
+typedef struct
+{
+   unsigned long steps;
+   unsigned long opcodes [RAM_HALT + 1];
+   unsigned long pointer_operands, indirect_operands;
+
+   unsigned long lookups, cache_hits;
+   int memory_sampled;
+
+   unsigned long wide_steps;
+   size_t max_limbs;
+}
+RAM_RuntimeProfile;
+
+typedef struct
+{
+   unsigned long profile_steps;
+   RAM_RuntimeProfile profile;
+   RAM_MemoryHooks hooks;
+
+   int decided;
+   int native, operand_cache, compaction;
+   RAM_SegmentIndexType index;
+   unsigned int segments;
+}
+RAM_Adaptive;
+
+RAM_Adaptive *ram_adaptive_new (unsigned long profile_steps);
+void ram_adaptive_delete (RAM_Adaptive *);
+
+unsigned long ram_adaptive_run (RAM_Adaptive *, RAM *, unsigned long steps);
+void ram_adaptive_report (RAM_Adaptive *, FILE *);
+
+#endif
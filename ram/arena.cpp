@@ -0,0 +1,195 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "arena.h"
+
+/* Size-class allocator for GMP limbs.  Blocks are carved from chunks
+   owned by one arena; every block starts with a header naming its arena
+   (NULL for blocks that came from malloc), so free and realloc never
+   need the arena to be current.  An arena is not locked: freeing pushes
+   onto the owner's free list, so its blocks may only be freed or resized
+   by the thread that runs its machine.  A block that has to grow is
+   moved to the current arena, which is its own during a step; resized
+   with another arena or none current, it migrates there or to malloc,
+   and is freed into that one afterwards. */
+
+typedef struct
+{
+   RAM_Arena *arena;
+   size_t size_class;
+}
+BlockHeader;
+
+static const size_t MIN_BLOCK = 16;
+static const size_t CHUNK_SIZE = 64 * 1024;
+static const size_t CHUNK_HEADER = (sizeof (RAM_ArenaChunk) + 15) & ~15;
+
+static __thread RAM_Arena *current_arena;
+
+static inline int size_class (size_t size)
+{
+   int c = 0;
+
+   while ((MIN_BLOCK << c) < size)
+      c ++;
+
+   return c;
+}
+
+RAM_Arena *ram_arena_new ()
+{
+   RAM_Arena *arena = (RAM_Arena *) calloc (1, sizeof (RAM_Arena));
+   if (!arena)
+      err_fatal_perror ("calloc", "could not allocate RAM_Arena structure");
+
+   return arena;
+}
+
+void ram_arena_release (RAM_Arena *arena)
+{
+   while (arena -> chunks)
+   {
+      RAM_ArenaChunk *chunk = (arena -> chunks);
+
+      (arena -> chunks) = (chunk -> next);
+      free (chunk);
+   }
+
+   memset ((arena -> free_list), 0, sizeof (arena -> free_list));
+   (arena -> chunk_bytes) = 0;
+}
+
+void ram_arena_delete (RAM_Arena *arena)
+{
+   if (current_arena == arena)
+      current_arena = NULL;
+
+   ram_arena_release (arena);
+   free (arena);
+}
+
+RAM_Arena *ram_arena_enter (RAM_Arena *arena)
+{
+   RAM_Arena *previous = current_arena;
+
+   current_arena = arena;
+
+   return previous;
+}
+
+void ram_arena_leave (RAM_Arena *previous)
+{
+   current_arena = previous;
+}
+
+RAM_Arena *ram_arena_current ()
+{
+   return current_arena;
+}
+
+static BlockHeader *arena_block (RAM_Arena *arena, int c)
+{
+   size_t size = sizeof (BlockHeader) + (MIN_BLOCK << c);
+   BlockHeader *block;
+
+   if (arena -> free_list [c])
+   {
+      block = (BlockHeader *) (arena -> free_list [c]);
+      (arena -> free_list [c]) = *(void **) (block + 1);
+   }
+   else
+   {
+      RAM_ArenaChunk *chunk = (arena -> chunks);
+
+      if (!chunk || (chunk -> used) + size > (chunk -> size))
+      {
+	 chunk = (RAM_ArenaChunk *) malloc (CHUNK_HEADER + CHUNK_SIZE);
+	 if (!chunk)
+	    err_fatal_perror ("malloc", "could not allocate arena chunk");
+
+	 (chunk -> size) = CHUNK_SIZE;
+	 (chunk -> used) = 0;
+	 (chunk -> next) = (arena -> chunks);
+	 (arena -> chunks) = chunk;
+	 (arena -> chunk_bytes) += CHUNK_SIZE;
+      }
+
+      block = (BlockHeader *) ((char *) chunk + CHUNK_HEADER +
+		      (chunk -> used));
+      (chunk -> used) += size;
+   }
+
+   (block -> arena) = arena;
+   (block -> size_class) = c;
+
+   return block;
+}
+
+static BlockHeader *malloc_block (size_t size)
+{
+   BlockHeader *block =
+	   (BlockHeader *) malloc (sizeof (BlockHeader) + size);
+   if (!block)
+      err_fatal_perror ("malloc", "could not allocate %lu bytes",
+		      (unsigned long) size);
+
+   (block -> arena) = NULL;
+   (block -> size_class) = 0;
+
+   return block;
+}
+
+void *ram_arena_allocate (size_t size)
+{
+   BlockHeader *block;
+
+   if (current_arena && size <= (MIN_BLOCK << (RAM_ARENA_CLASSES - 1)))
+      block = arena_block (current_arena, size_class (size));
+   else
+      block = malloc_block (size);
+
+   return block + 1;
+}
+
+void ram_arena_free (void *p, size_t)
+{
+   BlockHeader *block = ((BlockHeader *) p) - 1;
+   RAM_Arena *arena = (block -> arena);
+
+   if (arena)
+   {
+      *(void **) p = (arena -> free_list [block -> size_class]);
+      (arena -> free_list [block -> size_class]) = block;
+   }
+   else
+      free (block);
+}
+
+void *ram_arena_reallocate (void *p, size_t old_size, size_t new_size)
+{
+   BlockHeader *block = ((BlockHeader *) p) - 1;
+   void *q;
+
+   if (!(block -> arena))
+   {
+      block = (BlockHeader *) realloc (block,
+		      sizeof (BlockHeader) + new_size);
+      if (!block)
+	 err_fatal_perror ("realloc",
+		"could not resize block (old size %lu, new size %lu)",
+		(unsigned long) old_size, (unsigned long) new_size);
+
+      return block + 1;
+   }
+
+   if (new_size <= (MIN_BLOCK << (block -> size_class)))
+      return p;
+
+   /* From the block's own arena when it is current (during a step),
+      otherwise the block migrates as described at the top. */
+   q = ram_arena_allocate (new_size);
+   memcpy (q, p, (old_size < new_size) ? old_size : new_size);
+   ram_arena_free (p, old_size);
+
+   return q;
+}
@@ -0,0 +1,38 @@
+#ifndef RAM_ARENA_H
+#define RAM_ARENA_H
+
+#include <stdio.h>
+#include <stdlib.h>
+
+
+#define RAM_ARENA_CLASSES 11
+
+typedef struct _RAM_ArenaChunk
+{
+   struct _RAM_ArenaChunk *next;
+   size_t size, used;
+}
+RAM_ArenaChunk;
+
+typedef struct
+{
+   void *free_list [RAM_ARENA_CLASSES];
+   RAM_ArenaChunk *chunks;
+   size_t chunk_bytes;
+}
+RAM_Arena;
+
+RAM_Arena *ram_arena_new ();
+void ram_arena_delete (RAM_Arena *);
+
+void ram_arena_release (RAM_Arena *);
+
+RAM_Arena *ram_arena_enter (RAM_Arena *);
+void ram_arena_leave (RAM_Arena *previous);
+RAM_Arena *ram_arena_current ();
+
+void *ram_arena_allocate (size_t);
+void *ram_arena_reallocate (void *, size_t old_size, size_t new_size);
+void ram_arena_free (void *, size_t);
+
+#endif
@@ -0,0 +1,646 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <zlib.h>
+#include <gmp.h>
+#include "checkpoint.h"
+#include "kernels.h"
+
+/* A checkpoint file is a sequence of records.  A full record ('F')
+   holds every segment, an incremental one ('I') only the segments that
+   were touched since the previous record.  Resuming replays all
+   complete records, so a record cut short by a crash is ignored.
+
+   record:  "RAMC" kind:u8 program_hash:u64 current_instruction:u32
+	    instructions_done:mpz time_consumed:mpz
+	    input_offset:i64 output_offset:i64 segments:u32
+	    { begin:mpz registers:u32 { offset:u32 value:mpz } } "DONE"
+
+   Integers are little endian, mpz values use the mpz_out_raw format.
+   With the background writer running, records are snapshotted on the
+   execution thread and serialized by the writer.
+
+   Taking the snapshot still stalls the machine for as long as copying
+   takes.  For an incremental record that is the segments written since
+   the previous one, but a full record copies every written register,
+   so the first record, the one after a memory reset and one in every
+   full_every are as slow as the memory is large.  The copy is not made
+   lazily per segment because register 0 is written without going
+   through the dirty barrier and segment merges move registers between
+   nodes under a pending copy; large machines should raise full_every
+   with ram_checkpoint_set_full_every instead. */
+
+static const char RECORD_START [] = "RAMC", RECORD_END [] = "DONE",
+		  COMPRESSED_START [] = "RAMZ";
+
+static const unsigned long FULL_EVERY = 64;
+
+RAM_Checkpoint *ram_checkpoint_new (const char *path, unsigned long interval)
+{
+   RAM_Checkpoint *cp;
+
+   cp = (RAM_Checkpoint *) calloc (1, sizeof (RAM_Checkpoint));
+   if (!cp)
+      err_fatal_perror ("calloc",
+		      "could not allocate RAM_Checkpoint structure");
+
+   (cp -> path) = strdup (path);
+   (cp -> interval) = interval;
+   (cp -> full_every) = FULL_EVERY;
+
+   return cp;
+}
+
+void ram_checkpoint_set_full_every (RAM_Checkpoint *cp, unsigned long records)
+{
+   (cp -> full_every) = records ? records : FULL_EVERY;
+}
+
+void ram_checkpoint_delete (RAM_Checkpoint *cp)
+{
+   ram_checkpoint_stop_writer (cp);
+
+   if (cp -> file)
+      fclose (cp -> file);
+
+   free (cp -> path);
+   free (cp);
+}
+
+
+static void put_bytes (FILE *f, const void *p, size_t n)
+{
+   if (fwrite (p, 1, n, f) != n)
+      err_fatal_perror ("fwrite", "could not write checkpoint");
+}
+
+static void put_u64 (FILE *f, unsigned long v, int bytes)
+{
+   unsigned char buf [8];
+   int i;
+
+   for (i = 0; i < bytes; i ++)
+      buf [i] = (v >> (8 * i)) & 0xff;
+
+   put_bytes (f, buf, bytes);
+}
+
+static void put_mpz (FILE *f, mpz_t v)
+{
+   if (!mpz_out_raw (f, v))
+      err_fatal_perror ("mpz_out_raw", "could not write checkpoint");
+}
+
+typedef struct
+{
+   mpz_t begin;
+   unsigned int count;
+   unsigned int *offsets;
+   mpz_t *values;
+}
+SnapshotSegment;
+
+struct _RAM_Snapshot
+{
+   int full, deep;
+
+   unsigned long hash;
+   unsigned int current_instruction;
+   mpz_t instructions_done, time_consumed;
+   long input_offset, output_offset;
+
+   unsigned int count;
+   SnapshotSegment *segments;
+};
+
+/* A shallow snapshot shares the registers' limbs and is only valid until
+   the machine runs again; a deep one owns copies of them, made here on
+   the execution thread. */
+static RAM_Snapshot *take_snapshot (RAM *machine, int full, int deep)
+{
+   RAM_Memory *memory = (machine -> memory);
+   RAM_Snapshot *s;
+   RAM_AVL_Node *node;
+   RAM_Arena *arena;
+   unsigned int n = 0;
+
+   s = (RAM_Snapshot *) calloc (1, sizeof (RAM_Snapshot));
+   if (!s)
+      err_fatal_perror ("calloc", "could not allocate checkpoint snapshot");
+
+   arena = ram_arena_enter (NULL);
+
+   (s -> full) = full;
+   (s -> deep) = deep;
+   (s -> hash) = ram_program_hash (machine -> program);
+   (s -> current_instruction) = (machine -> current_instruction);
+   mpz_init_set ((s -> instructions_done), (machine -> instructions_done));
+   mpz_init_set ((s -> time_consumed), (machine -> time_consumed));
+   (s -> input_offset) = (machine -> input) ? ftell (machine -> input) : -1;
+   (s -> output_offset) =
+	   (machine -> output) ? ftell (machine -> output) : -1;
+
+   /* Stores mark their segment dirty; the first segment is always
+      recorded, since READ and the accumulator opcodes set register 0
+      without marking it. */
+#define SEGMENT_NEEDED(node) \
+   (full || (node -> dirty) || (node) == (memory -> begin))
+
+   for (node = ram_memory_first_segment (memory); node;
+		   node = ram_memory_next_segment (node))
+      if (SEGMENT_NEEDED (node))
+	 (s -> count) ++;
+
+   (s -> segments) = (SnapshotSegment *)
+	   calloc ((s -> count) + 1, sizeof (SnapshotSegment));
+   if (!(s -> segments))
+      err_fatal_perror ("calloc", "could not allocate checkpoint snapshot");
+
+   for (node = ram_memory_first_segment (memory); node;
+		   node = ram_memory_next_segment (node))
+      if (SEGMENT_NEEDED (node))
+      {
+	 SnapshotSegment *seg = (s -> segments) + n ++;
+	 unsigned int i, j = 0;
+
+	 (seg -> count) = ram_kernel_count_set ((node -> written),
+			 (node -> size));
+
+	 mpz_init_set ((seg -> begin), (node -> begin));
+	 (seg -> offsets) = (unsigned int *)
+		 malloc (((seg -> count) + 1) * sizeof (unsigned int));
+	 (seg -> values) = (mpz_t *)
+		 malloc (((seg -> count) + 1) * sizeof (mpz_t));
+	 if (!(seg -> offsets) || !(seg -> values))
+	    err_fatal_perror ("malloc",
+			"could not allocate checkpoint snapshot");
+
+	 for (i = ram_kernel_next_set ((node -> written), 0, (node -> size));
+		 i < (node -> size);
+		 i = ram_kernel_next_set ((node -> written), i + 1,
+			 (node -> size)))
+	    {
+	       (seg -> offsets) [j] = i;
+	       if (deep)
+		  mpz_init_set ((seg -> values) [j], (node -> segment) [i]);
+	       else
+		  memcpy ((seg -> values) [j], (node -> segment) [i],
+				  sizeof (mpz_t));
+	       j ++;
+	    }
+
+	 (node -> dirty) = 0;
+      }
+
+#undef SEGMENT_NEEDED
+
+   ram_arena_leave (arena);
+
+   return s;
+}
+
+static void snapshot_delete (RAM_Snapshot *s)
+{
+   unsigned int i, j;
+
+   for (i = 0; i < (s -> count); i ++)
+   {
+      SnapshotSegment *seg = (s -> segments) + i;
+
+      mpz_clear (seg -> begin);
+      if (s -> deep)
+	 for (j = 0; j < (seg -> count); j ++)
+	    mpz_clear ((seg -> values) [j]);
+
+      free (seg -> offsets);
+      free (seg -> values);
+   }
+
+   mpz_clear (s -> instructions_done);
+   mpz_clear (s -> time_consumed);
+
+   free (s -> segments);
+   free (s);
+}
+
+static void write_snapshot (FILE *f, RAM_Snapshot *s)
+{
+   unsigned int i, j;
+
+   put_bytes (f, RECORD_START, 4);
+   put_u64 (f, (s -> full) ? 'F' : 'I', 1);
+   put_u64 (f, (s -> hash), 8);
+   put_u64 (f, (s -> current_instruction), 4);
+   put_mpz (f, (s -> instructions_done));
+   put_mpz (f, (s -> time_consumed));
+   put_u64 (f, (s -> input_offset), 8);
+   put_u64 (f, (s -> output_offset), 8);
+   put_u64 (f, (s -> count), 4);
+
+   for (i = 0; i < (s -> count); i ++)
+   {
+      SnapshotSegment *seg = (s -> segments) + i;
+
+      put_mpz (f, (seg -> begin));
+      put_u64 (f, (seg -> count), 4);
+      for (j = 0; j < (seg -> count); j ++)
+      {
+	 put_u64 (f, (seg -> offsets) [j], 4);
+	 put_mpz (f, (seg -> values) [j]);
+      }
+   }
+
+   put_bytes (f, RECORD_END, 4);
+}
+
+/* Compressed records are framed as "RAMZ" raw_size:u32 packed_size:u32
+   followed by the deflated record. */
+static void write_compressed (FILE *f, RAM_Snapshot *s)
+{
+   char *raw = NULL;
+   size_t raw_size = 0;
+   uLongf packed_size;
+   Bytef *packed;
+   FILE *mem;
+
+   mem = open_memstream (&raw, &raw_size);
+   if (!mem)
+      err_fatal_perror ("open_memstream", "could not buffer checkpoint");
+   write_snapshot (mem, s);
+   fclose (mem);
+
+   packed_size = compressBound (raw_size);
+   packed = (Bytef *) malloc (packed_size);
+   if (!packed)
+      err_fatal_perror ("malloc", "could not buffer checkpoint");
+
+   if (compress2 (packed, &packed_size, (Bytef *) raw, raw_size, 1) != Z_OK)
+      err_fatal_perror ("compress2", "could not compress checkpoint");
+
+   put_bytes (f, COMPRESSED_START, 4);
+   put_u64 (f, raw_size, 4);
+   put_u64 (f, packed_size, 4);
+   put_bytes (f, packed, packed_size);
+
+   free (packed);
+   free (raw);
+}
+
+static void store_snapshot (RAM_Checkpoint *cp, RAM_Snapshot *s)
+{
+   FILE *f;
+   char *tmp = NULL;
+
+   if (s -> full)
+   {
+      tmp = (char *) malloc (strlen (cp -> path) + 5);
+      sprintf (tmp, "%s.tmp", (cp -> path));
+      f = fopen (tmp, "wb");
+      if (!f)
+	 err_fatal_perror ("fopen", "could not create %s", tmp);
+   }
+   else
+      f = (cp -> file);
+
+   if (cp -> compress)
+      write_compressed (f, s);
+   else
+      write_snapshot (f, s);
+
+   if (fflush (f))
+      err_fatal_perror ("fflush", "could not write checkpoint");
+
+   if (s -> full)
+   {
+      fsync (fileno (f));
+      fclose (f);
+
+      if (rename (tmp, (cp -> path)))
+	 err_fatal_perror ("rename", "could not replace %s", (cp -> path));
+      free (tmp);
+
+      if (cp -> file)
+	 fclose (cp -> file);
+      (cp -> file) = fopen ((cp -> path), "ab");
+      if (!(cp -> file))
+	 err_fatal_perror ("fopen", "could not open %s", (cp -> path));
+   }
+}
+
+
+static void *writer_thread (void *data)
+{
+   RAM_Checkpoint *cp = (RAM_Checkpoint *) data;
+
+   pthread_mutex_lock (&(cp -> lock));
+   for (;;)
+   {
+      RAM_Snapshot *s;
+
+      while (!(cp -> queued) && (cp -> running))
+	 pthread_cond_wait (&(cp -> not_empty), &(cp -> lock));
+
+      if (!(cp -> queued))
+	 break;
+
+      s = (cp -> queue) [cp -> head];
+      pthread_mutex_unlock (&(cp -> lock));
+
+      store_snapshot (cp, s);
+      snapshot_delete (s);
+
+      pthread_mutex_lock (&(cp -> lock));
+      (cp -> head) = ((cp -> head) + 1) % (cp -> capacity);
+      (cp -> queued) --;
+      pthread_cond_broadcast (&(cp -> not_full));
+   }
+   pthread_mutex_unlock (&(cp -> lock));
+
+   return NULL;
+}
+
+void ram_checkpoint_start_writer (RAM_Checkpoint *cp, unsigned int capacity,
+					int compress)
+{
+   if (cp -> running)
+      return;
+
+   (cp -> queue) = (RAM_Snapshot **)
+	   calloc (capacity, sizeof (RAM_Snapshot *));
+   if (!(cp -> queue))
+      err_fatal_perror ("calloc", "could not allocate checkpoint queue");
+
+   (cp -> capacity) = capacity;
+   (cp -> head) = (cp -> queued) = 0;
+   (cp -> compress) = compress;
+   (cp -> running) = 1;
+
+   pthread_mutex_init (&(cp -> lock), NULL);
+   pthread_cond_init (&(cp -> not_empty), NULL);
+   pthread_cond_init (&(cp -> not_full), NULL);
+
+   if (pthread_create (&(cp -> thread), NULL, writer_thread, cp))
+      err_fatal_perror ("pthread_create",
+		      "could not start checkpoint writer");
+}
+
+void ram_checkpoint_stop_writer (RAM_Checkpoint *cp)
+{
+   if (!(cp -> running))
+      return;
+
+   pthread_mutex_lock (&(cp -> lock));
+   (cp -> running) = 0;
+   pthread_cond_signal (&(cp -> not_empty));
+   pthread_mutex_unlock (&(cp -> lock));
+
+   pthread_join ((cp -> thread), NULL);
+
+   pthread_mutex_destroy (&(cp -> lock));
+   pthread_cond_destroy (&(cp -> not_empty));
+   pthread_cond_destroy (&(cp -> not_full));
+
+   free (cp -> queue);
+   (cp -> queue) = NULL;
+}
+
+static void enqueue_snapshot (RAM_Checkpoint *cp, RAM_Snapshot *s)
+{
+   pthread_mutex_lock (&(cp -> lock));
+
+   while ((cp -> queued) == (cp -> capacity))
+      pthread_cond_wait (&(cp -> not_full), &(cp -> lock));
+
+   (cp -> queue) [((cp -> head) + (cp -> queued)) % (cp -> capacity)] = s;
+   (cp -> queued) ++;
+
+   pthread_cond_signal (&(cp -> not_empty));
+   pthread_mutex_unlock (&(cp -> lock));
+}
+
+
+void ram_checkpoint_write (RAM_Checkpoint *cp, RAM *machine)
+{
+   RAM_Memory *memory = (machine -> memory);
+   RAM_Snapshot *s;
+   int full;
+
+   if (machine -> output)
+      fflush (machine -> output);
+
+   full = !(cp -> records) || (cp -> memory) != memory ||
+	   (cp -> resets) != (memory -> resets) ||
+	   (cp -> records) > (cp -> full_every);
+
+   s = take_snapshot (machine, full, (cp -> running));
+
+   if (full)
+   {
+      (cp -> memory) = memory;
+      (cp -> resets) = (memory -> resets);
+      (cp -> records) = 1;
+   }
+   else
+      (cp -> records) ++;
+
+   if (cp -> running)
+      enqueue_snapshot (cp, s);
+   else
+   {
+      store_snapshot (cp, s);
+      snapshot_delete (s);
+   }
+
+   (cp -> steps) = 0;
+}
+
+void ram_checkpoint_tick (RAM_Checkpoint *cp, RAM *machine)
+{
+   if (++ (cp -> steps) >= (cp -> interval))
+      ram_checkpoint_write (cp, machine);
+}
+
+void ram_checkpoint_run (RAM *machine, RAM_Checkpoint *cp)
+{
+   while (ram_do_instruction (machine))
+      ram_checkpoint_tick (cp, machine);
+
+   ram_checkpoint_write (cp, machine);
+}
+
+
+static int get_u64 (FILE *f, unsigned long *v, int bytes)
+{
+   unsigned char buf [8];
+   int i;
+
+   if (fread (buf, 1, bytes, f) != (size_t) bytes)
+      return 0;
+
+   (*v) = 0;
+   for (i = 0; i < bytes; i ++)
+      (*v) |= ((unsigned long) buf [i]) << (8 * i);
+
+   return 1;
+}
+
+static int get_tag (FILE *f, const char *tag)
+{
+   char buf [4];
+
+   return fread (buf, 1, 4, f) == 4 && !memcmp (buf, tag, 4);
+}
+
+static void seek_stream (FILE *stream, long offset, int truncate)
+{
+   if (!stream || offset < 0)
+      return;
+
+   fflush (stream);
+   if (!fseek (stream, offset, SEEK_SET) && truncate)
+      if (ftruncate (fileno (stream), offset))
+	 err_fatal_perror ("ftruncate", "could not rewind output");
+}
+
+/* Reads one record; when apply is set the record is also loaded into
+   the machine.  Returns 0 for a missing, truncated or foreign record. */
+static int read_record (FILE *f, RAM *machine, unsigned long hash,
+				int apply)
+{
+   unsigned long kind, value, position, input, output, count, registers;
+   mpz_t done, time, address, v;
+   int ok = 0;
+
+   if (!get_tag (f, RECORD_START) || !get_u64 (f, &kind, 1) ||
+	 !get_u64 (f, &value, 8) || value != hash ||
+	 !get_u64 (f, &position, 4))
+      return 0;
+
+   mpz_init (done);
+   mpz_init (time);
+   mpz_init (address);
+   mpz_init (v);
+
+   if (!mpz_inp_raw (done, f) || !mpz_inp_raw (time, f) ||
+	 !get_u64 (f, &input, 8) || !get_u64 (f, &output, 8) ||
+	 !get_u64 (f, &count, 4))
+      goto out;
+
+   if (apply && kind == 'F')
+      ram_memory_reset (machine -> memory);
+
+   while (count --)
+   {
+      mpz_t begin;
+
+      mpz_init (begin);
+      if (!mpz_inp_raw (begin, f) || !get_u64 (f, &registers, 4))
+      {
+	 mpz_clear (begin);
+	 goto out;
+      }
+
+      while (registers --)
+	 if (!get_u64 (f, &value, 4) || !mpz_inp_raw (v, f))
+	 {
+	    mpz_clear (begin);
+	    goto out;
+	 }
+	 else if (apply)
+	 {
+	    mpz_add_ui (address, begin, value);
+	    mpz_set (*ram_get_register_for_write ((machine -> memory),
+				    &address), v);
+	 }
+
+      mpz_clear (begin);
+   }
+
+   if (!get_tag (f, RECORD_END))
+      goto out;
+
+   if (apply)
+   {
+      (machine -> current_instruction) = position;
+      mpz_set ((machine -> instructions_done), done);
+      mpz_set ((machine -> time_consumed), time);
+      seek_stream ((machine -> input), (long) input, 0);
+      seek_stream ((machine -> output), (long) output, 1);
+   }
+
+   ok = 1;
+
+out:
+   mpz_clear (done);
+   mpz_clear (time);
+   mpz_clear (address);
+   mpz_clear (v);
+
+   return ok;
+}
+
+static int read_frame (FILE *f, RAM *machine, unsigned long hash,
+				int apply)
+{
+   unsigned long raw_size, packed_size;
+   uLongf size;
+   Bytef *raw, *packed;
+   FILE *mem;
+   int ok;
+
+   if (!get_tag (f, COMPRESSED_START))
+   {
+      fseek (f, -4, SEEK_CUR);
+      return read_record (f, machine, hash, apply);
+   }
+
+   if (!get_u64 (f, &raw_size, 4) || !get_u64 (f, &packed_size, 4))
+      return 0;
+
+   raw = (Bytef *) malloc (raw_size + 1);
+   packed = (Bytef *) malloc (packed_size + 1);
+   if (!raw || !packed)
+      err_fatal_perror ("malloc", "could not buffer checkpoint");
+
+   size = raw_size;
+   ok = fread (packed, 1, packed_size, f) == packed_size &&
+	   uncompress (raw, &size, packed, packed_size) == Z_OK &&
+	   size == raw_size;
+
+   if (ok)
+   {
+      mem = fmemopen (raw, raw_size, "rb");
+      ok = mem && read_record (mem, machine, hash, apply);
+      if (mem)
+	 fclose (mem);
+   }
+
+   free (raw);
+   free (packed);
+
+   return ok;
+}
+
+int ram_checkpoint_resume (RAM *machine, const char *path)
+{
+   unsigned long hash = ram_program_hash (machine -> program);
+   long end = 0;
+   FILE *f;
+
+   f = fopen (path, "rb");
+   if (!f)
+      return 0;
+
+   while (read_frame (f, machine, hash, 0))
+      end = ftell (f);
+
+   rewind (f);
+   while (ftell (f) < end)
+      read_frame (f, machine, hash, 1);
+
+   fclose (f);
+
+   return end > 0;
+}
@@ -0,0 +1,47 @@
+#ifndef RAM_CHECKPOINT_H
+#define RAM_CHECKPOINT_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include "ram.h"
+
+
+typedef struct _RAM_Snapshot RAM_Snapshot;
+
+typedef struct
+{
+   char *path;
+   FILE *file;
+
+   unsigned long interval, steps;
+   unsigned long records, full_every;
+
+   RAM_Memory *memory;
+   unsigned int resets;
+
+   int running, compress;
+   pthread_t thread;
+   pthread_mutex_t lock;
+   pthread_cond_t not_empty, not_full;
+   RAM_Snapshot **queue;
+   unsigned int capacity, head, queued;
+}
+RAM_Checkpoint;
+
+RAM_Checkpoint *ram_checkpoint_new (const char *path, unsigned long interval);
+void ram_checkpoint_delete (RAM_Checkpoint *);
+
+void ram_checkpoint_set_full_every (RAM_Checkpoint *, unsigned long records);
+
+void ram_checkpoint_write (RAM_Checkpoint *, RAM *);
+void ram_checkpoint_tick (RAM_Checkpoint *, RAM *);
+void ram_checkpoint_run (RAM *, RAM_Checkpoint *);
+
+void ram_checkpoint_start_writer (RAM_Checkpoint *, unsigned int capacity,
+					int compress);
+void ram_checkpoint_stop_writer (RAM_Checkpoint *);
+
+int ram_checkpoint_resume (RAM *, const char *path);
+
+#endif
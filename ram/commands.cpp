@@ -1,5 +1,6 @@
 #include <stdarg.h>
 #include "ram.h"
+#include "pipeline.h"
 
 RAM *ram_new_by_program (RAM_Program *program)
 {
@@ -9,6 +10,27 @@ RAM *ram_new_by_program (RAM_Program *program)
    (machine -> program) = program;
    (machine -> current_instruction) = 0;
 
+   (machine -> operands) = (RAM_OperandCache *)
+	   calloc ((program -> n), sizeof (RAM_OperandCache));
+   if ((program -> n) && !(machine -> operands))
+      err_fatal_perror ("calloc", "could not allocate %d operand caches",
+		      (program -> n));
+
+   if (program -> tape_count)
+   {
+      unsigned int i;
+
+      (machine -> tapes) = (RAM_Tape *)
+	      calloc ((program -> tape_count), sizeof (RAM_Tape));
+      if (!(machine -> tapes))
+	 err_fatal_perror ("calloc", "could not allocate %d tapes",
+			 (program -> tape_count));
+
+      (machine -> tape_count) = (program -> tape_count);
+      for (i = 0; i < (program -> tape_count); i ++)
+	 (machine -> tapes) [i].name = (program -> tape_names) [i];
+   }
+
    return machine;
 }
 
@@ -30,23 +52,66 @@ static const InstructionHandler *instruction [] =
 int ram_do_instruction (RAM *machine)
 {
    RAM_Instruction *i;
+   RAM_Arena *arena;
+   int done;
 
    if (!ram_is_running (machine))
       return 0;
 
    i = (machine -> program -> instructions) [machine -> current_instruction];
+   (machine -> waiting) = NULL;
 
-   if ((instruction [i -> instruction]) (machine, i))
-   {
+   arena = ram_arena_enter (machine -> memory -> arena);
+   done = (instruction [i -> instruction]) (machine, i);
+   ram_arena_leave (arena);
+
+   if (done)
       mpz_add_ui ((machine -> instructions_done),
 		      (machine -> instructions_done), 1);
-      return ram_is_running (machine);
+
+   return done ? ram_is_running (machine) : 0;
+}
+
+int ram_step (RAM *machine)
+{
+   RAM_Instruction *i;
+
+   i = (machine -> program -> instructions) [machine -> current_instruction];
+
+   return (instruction [i -> instruction]) (machine, i);
+}
+
+unsigned long ram_run (RAM *machine, unsigned long steps)
+{
+   RAM_Arena *arena;
+   unsigned long done = 0;
+
+   if (machine -> program -> native)
+      return (machine -> program -> native) (machine, steps);
+
+   (machine -> waiting) = NULL;
+
+   arena = ram_arena_enter (machine -> memory -> arena);
+   while (done < steps && ram_is_running (machine))
+   {
+      RAM_Instruction *i;
+
+      i = (machine -> program -> instructions)
+	      [machine -> current_instruction];
+      if (!(instruction [i -> instruction]) (machine, i))
+	 break;
+
+      done ++;
    }
+   ram_arena_leave (arena);
+
+   mpz_add_ui ((machine -> instructions_done),
+		   (machine -> instructions_done), done);
 
-   return 0;
+   return done;
 }
 
-inline int ram_is_running (RAM *machine)
+int ram_is_running (RAM *machine)
 {
    if ((machine -> current_instruction) >= (machine -> program -> n))
       return 0;
@@ -62,9 +127,60 @@ static int ram_halt(RAM* machine, RAM_Instruction* i)
 }
 
 
+/* The counters are kept out of the machine's arena, which a memory
+   reset releases, so the cost is added with no arena current. */
+static void add_cost (RAM *machine)
+{
+   RAM_Arena *arena = ram_arena_enter (NULL);
+
+   add_register_0_cost (machine);
+   ram_arena_leave (arena);
+}
+
 static int ram_read (RAM *machine, RAM_Instruction *i)
 {
    char *line;
+   RAM_Tape *tape = ram_instruction_tape (machine, i);
+   RAM_Ring *ring = tape ? (tape -> ring) : (machine -> input_ring);
+
+   if (ring)
+   {
+      int got = ram_ring_try_get (ring,
+		      *ram_get_register_0 (machine -> memory));
+
+      if (got <= 0)
+      {
+	 if (!got)
+	 {
+	    (machine -> waiting) = ring;
+	    (machine -> waiting_for_write) = 0;
+	 }
+
+	 return 0;
+      }
+
+      (machine -> current_instruction) ++;
+
+      add_cost (machine);
+
+      return 1;
+   }
+
+   if (tape || (machine -> encoding) != RAM_TAPE_TEXT)
+   {
+      FILE *f = tape ? (tape -> file) : (machine -> input);
+
+      if (!f || !ram_tape_read (f, tape ? (tape -> encoding) :
+			      (machine -> encoding),
+			      *ram_get_register_0 (machine -> memory)))
+	 return 0;
+
+      (machine -> current_instruction) ++;
+
+      add_cost (machine);
+
+      return 1;
+   }
    
    io_prompt (machine, 1);
    
@@ -74,13 +190,51 @@ static int ram_read (RAM *machine, RAM_Instruction *i)
 
    (machine -> current_instruction) ++;
 
-   add_register_0_cost (machine);
+   add_cost (machine);
 
    return 1;
 }
 
 static int ram_write (RAM *machine, RAM_Instruction *i)
 {
+   RAM_Tape *tape = ram_instruction_tape (machine, i);
+   RAM_Ring *ring = tape ? (tape -> ring) : (machine -> output_ring);
+
+   if (ring)
+   {
+      int put = ram_ring_try_put (ring,
+		      *ram_get_register_0 (machine -> memory));
+
+      if (put <= 0)
+      {
+	 if (!put)
+	 {
+	    (machine -> waiting) = ring;
+	    (machine -> waiting_for_write) = 1;
+	 }
+
+	 return 0;
+      }
+
+      (machine -> current_instruction) ++;
+
+      return 1;
+   }
+
+   if (tape || (machine -> encoding) != RAM_TAPE_TEXT)
+   {
+      FILE *f = tape ? (tape -> file) : (machine -> output);
+
+      if (!f || !ram_tape_write (f, tape ? (tape -> encoding) :
+			      (machine -> encoding),
+			      *ram_get_register_0 (machine -> memory)))
+	 return 0;
+
+      (machine -> current_instruction) ++;
+
+      return 1;
+   }
+
    io_prompt (machine, 0);
    
    
@@ -91,14 +245,223 @@ static int ram_write (RAM *machine, RAM_Instruction *i)
    return 1;
 }
 
+/* Pointer operands remember the register they resolved to last time.
+   The entry is valid while the memory generation is unchanged, since
+   only resizing, joining or dropping segments moves registers.  For
+   [[n]] the address register is cached too, and a new address that
+   falls in the same segment is resolved without a tree lookup.  With
+   write set the segment of the register returned is marked dirty. */
+
+static mpz_t *get_operand (RAM *machine, RAM_Instruction *i, int write)
+{
+   RAM_Memory *memory = (machine -> memory);
+   RAM_OperandCache *c;
+   mpz_t *pointer, *target;
+   unsigned long generation;
+
+   if (!(machine -> operands) ||
+       ((i -> parameter_type) != RAM_POINTER &&
+	(i -> parameter_type) != RAM_INDIRECT_POINTER))
+   {
+      target = get_parameter_ptr (machine, i);
+      if (write && target)
+	 (memory -> cache -> dirty) = 1;
+
+      return target;
+   }
+
+   c = (machine -> operands) + (machine -> current_instruction);
+
+   if ((c -> generation) == (memory -> generation))
+   {
+      if (!(c -> pointer))
+      {
+	 (c -> node -> dirty) |= write;
+	 return (c -> target);
+      }
+
+      if (mpz_fits_ulong_p (*(c -> pointer)))
+      {
+	 unsigned long index = mpz_get_ui (*(c -> pointer)),
+		       offset = index - (c -> base);
+
+	 if (index != (c -> index) && offset < (c -> node -> size) &&
+	     (c -> node -> written) [offset])
+	 {
+	    (c -> index) = index;
+	    (c -> target) = (c -> node -> segment) + offset;
+	 }
+
+	 if (index == (c -> index))
+	 {
+	    (c -> node -> dirty) |= write;
+	    return (c -> target);
+	 }
+      }
+   }
+
+   (c -> generation) = 0;
+
+   if ((i -> parameter_type) == RAM_POINTER)
+   {
+      target = ram_get_register (memory, &(i -> parameter));
+
+      (c -> node) = (memory -> cache);
+      (c -> node -> dirty) |= write;
+      (c -> pointer) = NULL;
+      (c -> target) = target;
+      (c -> generation) = (memory -> generation);
+
+      return target;
+   }
+
+   pointer = ram_get_register (memory, &(i -> parameter));
+   if (mpz_sgn (*pointer) < 0)
+      return NULL;
+
+   generation = (memory -> generation);
+   target = ram_get_register (memory, pointer);
+   (c -> node) = (memory -> cache);
+   (c -> node -> dirty) |= write;
+
+   if (generation != (memory -> generation))
+      pointer = ram_get_register (memory, &(i -> parameter));
+
+   if (mpz_fits_ulong_p (*pointer) && !(c -> node -> wide))
+   {
+      (c -> base) = (c -> node -> first);
+      (c -> index) = mpz_get_ui (*pointer);
+      (c -> pointer) = pointer;
+      (c -> target) = target;
+      (c -> generation) = (memory -> generation);
+   }
+
+   return target;
+}
+
+/* Register 0 is pinned on the machine so the accumulator opcodes do not
+   walk from the memory to its first segment every time.  The pointer is
+   taken again whenever the memory or its generation changes, which is
+   when the first segment may have been reallocated. */
+
+mpz_t *ram_accumulator (RAM *machine)
+{
+   RAM_Memory *memory = (machine -> memory);
+
+   if ((machine -> accumulator_memory) != memory ||
+       (machine -> accumulator_generation) != (memory -> generation))
+   {
+      (machine -> accumulator) = ram_get_register_0 (memory);
+      (machine -> accumulator_memory) = memory;
+      (machine -> accumulator_generation) = (memory -> generation);
+   }
+
+   return (machine -> accumulator);
+}
+
+/* Register 0 takes almost every ADD, so it is added to in place at
+   the limb level.  It grows with spare limbs to keep a growing sum from
+   reallocating on every carry, and adding a register to itself is a
+   one bit shift. */
+
+static mp_ptr accumulator_limbs (mpz_t accumulator, mp_size_t limbs)
+{
+   if ((accumulator -> _mp_alloc) < limbs)
+      _mpz_realloc (accumulator, limbs + limbs / 2 + 2);
+
+   return mpz_limbs_modify (accumulator, limbs);
+}
+
+void ram_accumulator_add (mpz_t accumulator, mpz_t n)
+{
+   mp_size_t as = accumulator -> _mp_size, ns = n -> _mp_size,
+	     an = as < 0 ? - as : as, nn = ns < 0 ? - ns : ns;
+   mp_srcptr np;
+   mp_ptr ap;
+   mp_limb_t carry;
+   int negative, compare;
+
+   if (!nn)
+      return;
+
+   if (accumulator == n)
+   {
+      ap = accumulator_limbs (accumulator, an + 1);
+      ap [an] = mpn_lshift (ap, ap, an, 1);
+      mpz_limbs_finish (accumulator, as < 0 ? - (an + 1) : an + 1);
+      return;
+   }
+
+   if (!an || (as < 0) == (ns < 0))
+   {
+      mp_size_t size = an > nn ? an : nn;
+
+      negative = (ns < 0);
+      ap = accumulator_limbs (accumulator, size + 1);
+      np = mpz_limbs_read (n);
+
+      if (an >= nn)
+	 carry = mpn_add (ap, ap, an, np, nn);
+      else
+	 carry = mpn_add (ap, np, nn, ap, an);
+      ap [size] = carry;
+
+      mpz_limbs_finish (accumulator, negative ? - (size + 1) : size + 1);
+      return;
+   }
+
+   compare = (an != nn) ? (an > nn ? 1 : -1) :
+	   mpn_cmp (mpz_limbs_read (accumulator), mpz_limbs_read (n), an);
+
+   if (!compare)
+   {
+      accumulator -> _mp_size = 0;
+      return;
+   }
+
+   if (compare > 0)
+   {
+      negative = (as < 0);
+      ap = accumulator_limbs (accumulator, an);
+      mpn_sub (ap, ap, an, mpz_limbs_read (n), nn);
+      mpz_limbs_finish (accumulator, negative ? - an : an);
+   }
+   else
+   {
+      negative = (ns < 0);
+      ap = accumulator_limbs (accumulator, nn);
+      mpn_sub (ap, mpz_limbs_read (n), nn, ap, an);
+      mpz_limbs_finish (accumulator, negative ? - nn : nn);
+   }
+}
+
+/* HALF rounds toward zero, so it is a one bit shift of the magnitude
+   with the sign left alone. */
+
+void ram_accumulator_half (mpz_t accumulator)
+{
+   mp_size_t size = accumulator -> _mp_size,
+	     n = size < 0 ? - size : size;
+   mp_ptr limbs;
+
+   if (!n)
+      return;
+
+   limbs = mpz_limbs_modify (accumulator, n);
+   mpn_rshift (limbs, limbs, n, 1);
+   mpz_limbs_finish (accumulator, size < 0 ? - n : n);
+}
+
 static int ram_load (RAM *machine, RAM_Instruction *i)
 {
    mpz_t *n;
 
-   n = get_parameter_ptr (machine, i);
+   n = get_operand (machine, i, 0);
+   if (!n)
+      return 0;
    
       
-   mpz_set (*(ram_get_register_0 (machine -> memory)), *n);
+   mpz_set (*ram_accumulator (machine), *n);
 
    (machine -> current_instruction) ++;
 
@@ -109,10 +472,12 @@ static int ram_store (RAM *machine, RAM_Instruction *i)
 {
    mpz_t *n;
 
-   n = get_parameter_ptr (machine, i);
+   n = get_operand (machine, i, 1);
+   if (!n)
+      return 0;
   
    
-   mpz_set (*n, *(ram_get_register_0 (machine -> memory)));
+   mpz_set (*n, *ram_accumulator (machine));
 
    (machine -> current_instruction) ++;
 
@@ -122,12 +487,16 @@ static int ram_store (RAM *machine, RAM_Instruction *i)
 
 static int ram_add (RAM *machine, RAM_Instruction *i)
 {
-   mpz_t *n, *reg_0 = ram_get_register_0 (machine -> memory);
+   mpz_t *n, *reg_0;
+
+   n = get_operand (machine, i, 0);
+   if (!n)
+      return 0;
 
-   n = get_parameter_ptr (machine, i);
+   reg_0 = ram_accumulator (machine);
    
       
-   mpz_add (*reg_0, *reg_0, *n);
+   ram_accumulator_add (*reg_0, *n);
 
    (machine -> current_instruction) ++;
 
@@ -136,7 +505,7 @@ static int ram_add (RAM *machine, RAM_Instruction *i)
 
 static int ram_neg (RAM *machine, RAM_Instruction *i)
 {
-   mpz_t *reg_0 = ram_get_register_0 (machine -> memory);
+   mpz_t *reg_0 = ram_accumulator (machine);
    
    mpz_neg (*reg_0, *reg_0);
 
@@ -147,9 +516,7 @@ static int ram_neg (RAM *machine, RAM_Instruction *i)
 
 static int ram_half (RAM *machine, RAM_Instruction *i)
 {
-   mpz_t *reg_0 = ram_get_register_0 (machine -> memory);
-   
-   mpz_tdiv_q_2exp (*reg_0, *reg_0, 1);
+   ram_accumulator_half (*ram_accumulator (machine));
 
    (machine -> current_instruction) ++;
 
@@ -166,7 +533,7 @@ static int ram_jump (RAM *machine, RAM_Instruction *i)
 
 static int ram_jgtz (RAM *machine, RAM_Instruction *i)
 {
-   if (mpz_sgn (*ram_get_register_0 (machine -> memory)) > 0)
+   if ((*ram_accumulator (machine)) -> _mp_size > 0)
    {
       (machine -> current_instruction) =
 	      mpz_get_ui (i -> parameter) - 1;
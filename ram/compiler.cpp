@@ -0,0 +1,247 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <gmp.h>
+#include "compiler.h"
+
+/* Translates a program into a C++ source file with one label per
+   instruction and goto for control flow.  The generated NAME has the
+   signature of ram_run and keeps the same counters: every instruction
+   executed adds one step, a step budget stops it at the same place,
+   and a failing instruction leaves current_instruction on itself.
+   Every label stores current_instruction, one store per step, since
+   the SIGPROF profiler reads it from its signal handler to charge
+   samples.  Registers go through the RAM_Memory API; READ and WRITE
+   call back into the interpreter with ram_step, so tapes, rings and
+   costs behave exactly as interpreted.  NAME_install points the program's native
+   entry at NAME when the program hash matches, after which ram_run
+   and everything built on it use the compiled code. */
+
+#define NO_CONSTANT UINT_MAX
+
+typedef struct
+{
+   RAM_Program *program;
+   FILE *out;
+   unsigned int *constant;
+   unsigned int constants;
+}
+Emitter;
+
+static int small_constant (mpz_t c)
+{
+   return mpz_fits_slong_p (c) && mpz_cmp_si (c, - LONG_MAX) >= 0;
+}
+
+static int needs_table (RAM_Instruction *ri)
+{
+   switch (ri -> parameter_type)
+   {
+   case RAM_POINTER:
+   case RAM_INDIRECT_POINTER:
+      return 1;
+   case RAM_CONSTANT:
+      return !small_constant (ri -> parameter);
+   default:
+      return 0;
+   }
+}
+
+static void emit_exit (Emitter *e, const char *indent, unsigned long at)
+{
+   fprintf ((e -> out), "%s{\n%s   (machine -> current_instruction) = %lu;\n"
+		   "%s   goto out;\n%s}\n", indent, indent, at, indent, indent);
+}
+
+static void emit_jump (Emitter *e, const char *indent, RAM_Instruction *ri)
+{
+   unsigned long target = mpz_get_ui (ri -> parameter) - 1;
+
+   if (target < (e -> program -> n))
+      fprintf ((e -> out), "%sgoto i%lu;\n", indent, target);
+   else
+      emit_exit (e, indent, target);
+}
+
+static void emit_operand (Emitter *e, unsigned int i, RAM_Instruction *ri,
+			  int write)
+{
+   FILE *out = (e -> out);
+   const char *lookup = write ? "ram_get_register_for_write" :
+				"ram_get_register";
+
+   if ((ri -> parameter_type) == RAM_POINTER)
+      fprintf (out, "   n = %s (memory, constant + %u);\n", lookup,
+		      (e -> constant) [i]);
+   else
+   {
+      fprintf (out, "   n = ram_get_register (memory, constant + %u);\n"
+		      "   if (mpz_sgn (*n) < 0)\n", (e -> constant) [i]);
+      emit_exit (e, "   ", i);
+      fprintf (out, "   n = %s (memory, n);\n", lookup);
+   }
+}
+
+static void emit_instruction (Emitter *e, unsigned int i)
+{
+   RAM_Instruction *ri = (e -> program -> instructions) [i];
+   FILE *out = (e -> out);
+   int constant = (ri -> parameter_type) == RAM_CONSTANT,
+       table = ((e -> constant) [i] != NO_CONSTANT);
+
+   fprintf (out, "\ni%u:\n   (machine -> current_instruction) = %u;\n",
+		   i, i);
+
+   if ((ri -> instruction) == RAM_HALT)
+   {
+      emit_exit (e, "   ", i);
+      return;
+   }
+
+   fprintf (out, "   if (done == steps)\n");
+   emit_exit (e, "   ", i);
+
+   switch (ri -> instruction)
+   {
+   case RAM_READ:
+   case RAM_WRITE:
+      fprintf (out, "   if (!ram_step (machine))\n      goto out;\n");
+      break;
+
+   case RAM_LOAD:
+      if (constant && !table)
+	 fprintf (out, "   mpz_set_si (*ram_accumulator (machine), %ldL);\n",
+			 mpz_get_si (ri -> parameter));
+      else if (constant)
+	 fprintf (out, "   mpz_set (*ram_accumulator (machine), "
+			 "constant [%u]);\n", (e -> constant) [i]);
+      else
+      {
+	 emit_operand (e, i, ri, 0);
+	 fprintf (out, "   mpz_set (*ram_accumulator (machine), *n);\n");
+      }
+      break;
+
+   case RAM_STORE:
+      emit_operand (e, i, ri, 1);
+      fprintf (out, "   mpz_set (*n, *ram_accumulator (machine));\n");
+      break;
+
+   case RAM_ADD:
+      if (constant && !table)
+      {
+	 long c = mpz_get_si (ri -> parameter);
+
+	 fprintf (out, "   acc = ram_accumulator (machine);\n"
+			 "   mpz_%s_ui (*acc, *acc, %luUL);\n",
+			 c < 0 ? "sub" : "add",
+			 c < 0 ? (unsigned long) - c : (unsigned long) c);
+      }
+      else
+      {
+	 if (constant)
+	    fprintf (out, "   n = constant + %u;\n", (e -> constant) [i]);
+	 else
+	    emit_operand (e, i, ri, 0);
+	 fprintf (out, "   acc = ram_accumulator (machine);\n"
+			 "   ram_accumulator_add (*acc, *n);\n");
+      }
+      break;
+
+   case RAM_NEG:
+      fprintf (out, "   acc = ram_accumulator (machine);\n"
+		      "   mpz_neg (*acc, *acc);\n");
+      break;
+
+   case RAM_HALF:
+      fprintf (out, "   ram_accumulator_half "
+		      "(*ram_accumulator (machine));\n");
+      break;
+
+   case RAM_JUMP:
+      fprintf (out, "   done ++;\n");
+      emit_jump (e, "   ", ri);
+      return;
+
+   case RAM_JGTZ:
+      fprintf (out, "   done ++;\n"
+		      "   if ((*ram_accumulator (machine)) -> _mp_size > 0)\n");
+      emit_jump (e, "      ", ri);
+      return;
+
+   default:
+      break;
+   }
+
+   fprintf (out, "   done ++;\n");
+}
+
+int ram_program_compile (RAM_Program *program, FILE *out, const char *name)
+{
+   Emitter e;
+   unsigned int i;
+
+   (e.program) = program;
+   (e.out) = out;
+   (e.constants) = 0;
+   (e.constant) = (unsigned int *)
+	   malloc (((program -> n) + 1) * sizeof (unsigned int));
+   if (!(e.constant))
+      err_fatal_perror ("malloc", "could not allocate constant table");
+
+   for (i = 0; i < (program -> n); i ++)
+      (e.constant) [i] = needs_table ((program -> instructions) [i]) ?
+	      (e.constants) ++ : NO_CONSTANT;
+
+   fprintf (out, "/* Generated from a RAM program of %u instructions, "
+		   "hash %#lx. */\n\n", (program -> n), ram_program_hash (program));
+   fprintf (out, "#include <pthread.h>\n#include <gmp.h>\n"
+		   "#include \"ram.h\"\n\n");
+
+   fprintf (out, "static mpz_t constant [%u];\n", (e.constants) + 1);
+   fprintf (out, "static pthread_once_t constants_once = "
+		   "PTHREAD_ONCE_INIT;\n\n");
+   fprintf (out, "static void init_constants ()\n{\n");
+   for (i = 0; i < (program -> n); i ++)
+      if ((e.constant) [i] != NO_CONSTANT)
+	 gmp_fprintf (out, "   mpz_init_set_str (constant [%u], \"%Zd\", 10);\n",
+			 (e.constant) [i],
+			 (program -> instructions) [i] -> parameter);
+   fprintf (out, "}\n\n");
+
+   fprintf (out, "unsigned long %s (RAM *machine, unsigned long steps)\n{\n"
+		   "   RAM_Memory *memory = (machine -> memory);\n"
+		   "   RAM_Arena *arena;\n"
+		   "   mpz_t *n, *acc;\n"
+		   "   unsigned long done = 0;\n\n"
+		   "   pthread_once (&constants_once, init_constants);\n\n"
+		   "   (machine -> waiting) = NULL;\n"
+		   "   arena = ram_arena_enter (memory -> arena);\n\n"
+		   "   (void) n;\n   (void) acc;\n\n"
+		   "   switch (machine -> current_instruction)\n   {\n", name);
+   for (i = 0; i < (program -> n); i ++)
+      fprintf (out, "   case %u: goto i%u;\n", i, i);
+   fprintf (out, "   default: goto out;\n   }\n");
+
+   for (i = 0; i < (program -> n); i ++)
+      emit_instruction (&e, i);
+
+   fprintf (out, "\ni%u:\n   (machine -> current_instruction) = %u;\n\n",
+		   (program -> n), (program -> n));
+   fprintf (out, "out:\n"
+		   "   ram_arena_leave (arena);\n"
+		   "   mpz_add_ui ((machine -> instructions_done),\n"
+		   "\t\t   (machine -> instructions_done), done);\n\n"
+		   "   return done;\n}\n\n");
+
+   fprintf (out, "int %s_install (RAM_Program *program)\n{\n"
+		   "   if (ram_program_hash (program) != %#lxUL)\n"
+		   "      return 0;\n\n"
+		   "   (program -> native) = %s;\n\n"
+		   "   return 1;\n}\n", name, ram_program_hash (program), name);
+
+   free (e.constant);
+
+   return !ferror (out);
+}
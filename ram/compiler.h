@@ -0,0 +1,11 @@
+#ifndef RAM_COMPILER_H
+#define RAM_COMPILER_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "ram.h"
+
+
+int ram_program_compile (RAM_Program *, FILE *out, const char *name);
+
+#endif
@@ -0,0 +1,316 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <gmp.h>
+#include "debugger.h"
+
+/* Breakpoints and watchpoints are only checked by the stepping loop
+   below.  Continuing with none set goes through ram_run, so a machine
+   under the debugger runs the same loop as one without it until a
+   breakpoint is placed. */
+
+static const unsigned long CONTINUE_STEPS = 1UL << 16;
+
+static const char *reason_names [] =
+{
+   "stopped", "stepped", "breakpoint", "watchpoint", "halted", "failed"
+};
+
+RAM_Debugger *ram_debugger_new (RAM *machine)
+{
+   RAM_Debugger *dbg;
+
+   dbg = (RAM_Debugger *) calloc (1, sizeof (RAM_Debugger));
+   if (!dbg)
+      err_fatal_perror ("calloc", "could not allocate RAM_Debugger structure");
+
+   (dbg -> breakpoints) = (unsigned char *)
+	   calloc ((machine -> program -> n) + 1, 1);
+   if (!(dbg -> breakpoints))
+      err_fatal_perror ("calloc", "could not allocate %d breakpoints",
+		      (machine -> program -> n));
+
+   (dbg -> machine) = machine;
+   (dbg -> reason) = RAM_STOP_NONE;
+
+   return dbg;
+}
+
+void ram_debugger_delete (RAM_Debugger *dbg)
+{
+   unsigned int i;
+
+   for (i = 0; i < (dbg -> watchpoint_count); i ++)
+   {
+      mpz_clear ((dbg -> watchpoints) [i].address);
+      mpz_clear ((dbg -> watchpoints) [i].value);
+   }
+
+   free (dbg -> watchpoints);
+   free (dbg -> breakpoints);
+   free (dbg);
+}
+
+int ram_debugger_break (RAM_Debugger *dbg, unsigned int instruction)
+{
+   if (!instruction || instruction > (dbg -> machine -> program -> n))
+      return 0;
+
+   if (!(dbg -> breakpoints) [instruction - 1])
+   {
+      (dbg -> breakpoints) [instruction - 1] = 1;
+      (dbg -> breakpoint_count) ++;
+   }
+
+   return 1;
+}
+
+int ram_debugger_break_label (RAM_Debugger *dbg, const char *label)
+{
+   return ram_debugger_break (dbg,
+	   ram_program_find_label ((dbg -> machine -> program), label));
+}
+
+int ram_debugger_break_line (RAM_Debugger *dbg, unsigned int line)
+{
+   return ram_debugger_break (dbg,
+	   ram_program_find_line ((dbg -> machine -> program), line));
+}
+
+int ram_debugger_clear (RAM_Debugger *dbg, unsigned int instruction)
+{
+   if (!instruction || instruction > (dbg -> machine -> program -> n) ||
+       !(dbg -> breakpoints) [instruction - 1])
+      return 0;
+
+   (dbg -> breakpoints) [instruction - 1] = 0;
+   (dbg -> breakpoint_count) --;
+
+   return 1;
+}
+
+static void read_register (RAM_Debugger *dbg, mpz_t address, mpz_t value)
+{
+   mpz_t *r = ram_peek_register ((dbg -> machine -> memory),
+		   (mpz_t *) address);
+
+   if (r)
+      mpz_set (value, *r);
+   else
+      mpz_set_ui (value, 0);
+}
+
+unsigned int ram_debugger_watch (RAM_Debugger *dbg, mpz_t address)
+{
+   RAM_Watchpoint *w;
+
+   (dbg -> watchpoints) = (RAM_Watchpoint *) realloc ((dbg -> watchpoints),
+		   ((dbg -> watchpoint_count) + 1) * sizeof (RAM_Watchpoint));
+   if (!(dbg -> watchpoints))
+      err_fatal_perror ("realloc", "could not add watchpoint");
+
+   w = (dbg -> watchpoints) + (dbg -> watchpoint_count);
+   mpz_init_set ((w -> address), address);
+   mpz_init (w -> value);
+   read_register (dbg, (w -> address), (w -> value));
+   (w -> active) = 1;
+
+   (dbg -> watchpoints_active) ++;
+
+   return ++ (dbg -> watchpoint_count);
+}
+
+int ram_debugger_unwatch (RAM_Debugger *dbg, unsigned int watchpoint)
+{
+   if (!watchpoint || watchpoint > (dbg -> watchpoint_count) ||
+       !(dbg -> watchpoints) [watchpoint - 1].active)
+      return 0;
+
+   (dbg -> watchpoints) [watchpoint - 1].active = 0;
+   (dbg -> watchpoints_active) --;
+
+   return 1;
+}
+
+static int watchpoint_hit (RAM_Debugger *dbg)
+{
+   unsigned int i;
+   mpz_t value;
+   int hit = 0;
+
+   mpz_init (value);
+
+   for (i = 0; i < (dbg -> watchpoint_count) && !hit; i ++)
+   {
+      RAM_Watchpoint *w = (dbg -> watchpoints) + i;
+
+      if (!(w -> active))
+	 continue;
+
+      read_register (dbg, (w -> address), value);
+      if (mpz_cmp (value, (w -> value)))
+      {
+	 mpz_swap (value, (w -> value));
+	 (dbg -> watchpoint_hit) = i + 1;
+	 hit = 1;
+      }
+   }
+
+   mpz_clear (value);
+
+   return hit;
+}
+
+static RAM_StopReason stop (RAM_Debugger *dbg, RAM_StopReason reason)
+{
+   return (dbg -> reason) = reason;
+}
+
+RAM_StopReason ram_debugger_step (RAM_Debugger *dbg, unsigned long steps)
+{
+   RAM *machine = (dbg -> machine);
+   unsigned long done;
+
+   for (done = 0; ; done ++)
+   {
+      if (!ram_is_running (machine))
+	 return stop (dbg, RAM_STOP_HALTED);
+
+      if (done == steps)
+	 return stop (dbg, RAM_STOP_STEP);
+
+      if ((done || (dbg -> reason) == RAM_STOP_NONE) &&
+	  (dbg -> breakpoints) [machine -> current_instruction])
+	 return stop (dbg, RAM_STOP_BREAKPOINT);
+
+      if (!ram_do_instruction (machine) && ram_is_running (machine))
+	 return stop (dbg, RAM_STOP_FAILED);
+
+      if ((dbg -> watchpoints_active) && watchpoint_hit (dbg))
+	 return stop (dbg, RAM_STOP_WATCHPOINT);
+   }
+}
+
+RAM_StopReason ram_debugger_continue (RAM_Debugger *dbg)
+{
+   RAM *machine = (dbg -> machine);
+
+   if ((dbg -> breakpoint_count) || (dbg -> watchpoints_active))
+      return ram_debugger_step (dbg, ULONG_MAX);
+
+   while (ram_run (machine, CONTINUE_STEPS));
+
+   return stop (dbg, ram_is_running (machine) ?
+		   RAM_STOP_FAILED : RAM_STOP_HALTED);
+}
+
+void ram_debugger_where (RAM_Debugger *dbg, FILE *out)
+{
+   RAM *machine = (dbg -> machine);
+   RAM_Program *program = (machine -> program);
+   unsigned int ci = (machine -> current_instruction);
+
+   fprintf (out, "%s at instruction %u", reason_names [dbg -> reason],
+		   ci + 1);
+   if (ci < (program -> lines_size) && (program -> lines) [ci])
+      fprintf (out, ", line %u", (program -> lines) [ci]);
+   if ((dbg -> reason) == RAM_STOP_WATCHPOINT)
+      gmp_fprintf (out, ", register %Zd = %Zd",
+		      (dbg -> watchpoints) [dbg -> watchpoint_hit - 1].address,
+		      (dbg -> watchpoints) [dbg -> watchpoint_hit - 1].value);
+   gmp_fprintf (out, ", accumulator %Zd, %Zd steps\n",
+		   *ram_accumulator (machine),
+		   (machine -> instructions_done));
+}
+
+static int parse_number (const char *s, mpz_t n)
+{
+   return s && !mpz_set_str (n, s, 10);
+}
+
+void ram_debugger_session (RAM_Debugger *dbg, FILE *in, FILE *out)
+{
+   char *line;
+   mpz_t n;
+
+   mpz_init (n);
+
+   for (;;)
+   {
+      char *command, *argument, *rest;
+      int ok = 1;
+
+      fprintf (out, "(ram) ");
+      fflush (out);
+
+      line = read_line (in);
+      if (!line)
+	 break;
+
+      command = strtok_r (line, " \t\n", &rest);
+      argument = strtok_r (NULL, " \t\n", &rest);
+
+      if (!command)
+	 ;
+      else if (!strcmp (command, "break") || !strcmp (command, "b"))
+	 ok = parse_number (argument, n) ?
+		 ram_debugger_break (dbg, mpz_get_ui (n)) :
+		 argument && ram_debugger_break_label (dbg, argument);
+      else if (!strcmp (command, "line"))
+	 ok = parse_number (argument, n) &&
+		 ram_debugger_break_line (dbg, mpz_get_ui (n));
+      else if (!strcmp (command, "delete"))
+	 ok = parse_number (argument, n) &&
+		 ram_debugger_clear (dbg, mpz_get_ui (n));
+      else if (!strcmp (command, "watch"))
+      {
+	 ok = parse_number (argument, n);
+	 if (ok)
+	    fprintf (out, "watchpoint %u\n", ram_debugger_watch (dbg, n));
+      }
+      else if (!strcmp (command, "unwatch"))
+	 ok = parse_number (argument, n) &&
+		 ram_debugger_unwatch (dbg, mpz_get_ui (n));
+      else if (!strcmp (command, "step") || !strcmp (command, "s"))
+      {
+	 ram_debugger_step (dbg, parse_number (argument, n) ?
+			 mpz_get_ui (n) : 1);
+	 ram_debugger_where (dbg, out);
+      }
+      else if (!strcmp (command, "continue") || !strcmp (command, "c"))
+      {
+	 ram_debugger_continue (dbg);
+	 ram_debugger_where (dbg, out);
+      }
+      else if (!strcmp (command, "print") || !strcmp (command, "p"))
+      {
+	 ok = parse_number (argument, n);
+	 if (ok)
+	 {
+	    mpz_t value;
+
+	    mpz_init (value);
+	    read_register (dbg, n, value);
+	    gmp_fprintf (out, "[%Zd] = %Zd\n", n, value);
+	    mpz_clear (value);
+	 }
+      }
+      else if (!strcmp (command, "where"))
+	 ram_debugger_where (dbg, out);
+      else if (!strcmp (command, "quit") || !strcmp (command, "q"))
+      {
+	 free (line);
+	 break;
+      }
+      else
+	 ok = 0;
+
+      if (!ok)
+	 fprintf (out, "?\n");
+
+      free (line);
+   }
+
+   mpz_clear (n);
+}
@@ -0,0 +1,56 @@
+#ifndef RAM_DEBUGGER_H
+#define RAM_DEBUGGER_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <gmp.h>
+#include "ram.h"
+
+
+typedef enum
+{
+   RAM_STOP_NONE, RAM_STOP_STEP, RAM_STOP_BREAKPOINT, RAM_STOP_WATCHPOINT,
+   RAM_STOP_HALTED, RAM_STOP_FAILED
+}
+RAM_StopReason;
+
+typedef struct
+{
+   mpz_t address, value;
+   int active;
+}
+RAM_Watchpoint;
+
+typedef struct
+{
+   RAM *machine;
+
+   unsigned char *breakpoints;
+   unsigned int breakpoint_count;
+
+   RAM_Watchpoint *watchpoints;
+   unsigned int watchpoint_count, watchpoints_active;
+
+   RAM_StopReason reason;
+   unsigned int watchpoint_hit;
+}
+RAM_Debugger;
+
+RAM_Debugger *ram_debugger_new (RAM *);
+void ram_debugger_delete (RAM_Debugger *);
+
+int ram_debugger_break (RAM_Debugger *, unsigned int instruction);
+int ram_debugger_break_label (RAM_Debugger *, const char *label);
+int ram_debugger_break_line (RAM_Debugger *, unsigned int line);
+int ram_debugger_clear (RAM_Debugger *, unsigned int instruction);
+
+unsigned int ram_debugger_watch (RAM_Debugger *, mpz_t address);
+int ram_debugger_unwatch (RAM_Debugger *, unsigned int watchpoint);
+
+RAM_StopReason ram_debugger_step (RAM_Debugger *, unsigned long steps);
+RAM_StopReason ram_debugger_continue (RAM_Debugger *);
+
+void ram_debugger_where (RAM_Debugger *, FILE *);
+void ram_debugger_session (RAM_Debugger *, FILE *in, FILE *out);
+
+#endif
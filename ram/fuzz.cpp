@@ -0,0 +1,600 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <gmp.h>
+#include "fuzz.h"
+
+/* Differential testing of the execution engines.  Random programs are
+   run on two machines, one step at a time, and the machines are
+   compared after every step: current instruction, counters, output
+   position and every nonzero register.  The first step at which they
+   disagree is reported together with the program and both states.
+   ram_fuzz_compare_batches runs both machines with a larger budget
+   and compares after every batch instead, so engines that run many
+   steps per call (the native code) are exercised across instructions.
+
+   A program is fully determined by its seed, so a reported divergence
+   is reproduced with ram_fuzz_program and ram_fuzz_compare.  Tapes use
+   the binary encoding so that input and output do not depend on the
+   terminal. */
+
+static const unsigned int MAX_INSTRUCTIONS = 48, INPUT_VALUES = 8,
+			  DUMP_REGISTERS = 32;
+
+
+static void reference_prepare (RAM *machine)
+{
+   free (machine -> operands);
+   (machine -> operands) = NULL;
+}
+
+/* ram_do_instruction returns 0 both when an instruction fails and when
+   the machine stops after it, so progress is read from the counter. */
+static unsigned long reference_run (RAM *machine, unsigned long steps)
+{
+   unsigned long done = 0;
+
+   while (done < steps && ram_is_running (machine))
+   {
+      unsigned long before = mpz_get_ui (machine -> instructions_done);
+
+      ram_do_instruction (machine);
+      if (mpz_get_ui (machine -> instructions_done) == before)
+	 break;
+
+      done ++;
+   }
+
+   return done;
+}
+
+static void btree_prepare (RAM *machine)
+{
+   ram_memory_set_segment_index ((machine -> memory), RAM_INDEX_BTREE);
+}
+
+static void compacting_prepare (RAM *machine)
+{
+   ram_memory_set_compaction ((machine -> memory), 4, 64);
+}
+
+static const RAM_Engine engines [] =
+{
+   {"reference", reference_prepare, reference_run},
+   {"run", NULL, ram_run},
+   {"btree", btree_prepare, ram_run},
+   {"compacting", compacting_prepare, ram_run}
+};
+
+const RAM_Engine *ram_engine_find (const char *name)
+{
+   unsigned int i;
+
+   for (i = 0; i < sizeof (engines) / sizeof (engines [0]); i ++)
+      if (!strcmp (engines [i].name, name))
+	 return engines + i;
+
+   return NULL;
+}
+
+
+static unsigned long next_random (unsigned long *state)
+{
+   unsigned long z;
+
+   z = ((*state) += 0x9e3779b97f4a7c15UL);
+   z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9UL;
+   z = (z ^ (z >> 27)) * 0x94d049bb133111ebUL;
+
+   return z ^ (z >> 31);
+}
+
+/* Mostly small values, so that jumps are taken both ways, with some
+   that need one or more full limbs. */
+static void random_constant (unsigned long *state, mpz_t value)
+{
+   unsigned long r = next_random (state);
+
+   switch (r % 16)
+   {
+   case 10: case 11: case 12:
+      mpz_set_si (value, (long) next_random (state));
+      break;
+
+   case 13: case 14:
+      mpz_set_ui (value, 1);
+      mpz_mul_2exp (value, value, 64 + (r >> 8) % 64);
+      mpz_add_ui (value, value, (r >> 16) % 4);
+      if ((r >> 24) & 1)
+	 mpz_neg (value, value);
+      break;
+
+   case 15:
+      mpz_set_ui (value, (r >> 8) % 4);
+      mpz_sub_ui (value, value, 1);
+      mpz_mul_2exp (value, value, 1);
+      break;
+
+   default:
+      mpz_set_si (value, (long) ((r >> 8) % 11) - 5);
+   }
+}
+
+/* Registers near 0, a few past the first block and a few beyond an
+   unsigned long, which live in wide segments. */
+static void random_address (unsigned long *state, mpz_t address)
+{
+   unsigned long r = next_random (state);
+
+   switch (r % 16)
+   {
+   case 13:
+      mpz_set_ui (address, 1000 + (r >> 8) % 64);
+      break;
+
+   case 14: case 15:
+      mpz_set_ui (address, 1);
+      mpz_mul_2exp (address, address, 64);
+      mpz_add_ui (address, address, (r >> 8) % 4);
+      break;
+
+   default:
+      mpz_set_ui (address, (r >> 8) % 8);
+   }
+}
+
+static void random_operand (unsigned long *state, RAM_Instruction *i,
+				int constant)
+{
+   unsigned long r = next_random (state) % 8;
+
+   mpz_init (i -> parameter);
+
+   if (constant && r < 3)
+   {
+      (i -> parameter_type) = RAM_CONSTANT;
+      random_constant (state, (i -> parameter));
+      return;
+   }
+
+   (i -> parameter_type) = r < 6 ? RAM_POINTER : RAM_INDIRECT_POINTER;
+   random_address (state, (i -> parameter));
+}
+
+RAM_Program *ram_fuzz_program (unsigned long seed)
+{
+   RAM_Program *program;
+   unsigned long state = seed;
+   unsigned int n, k;
+
+   program = ram_program_new ();
+
+   n = 4 + next_random (&state) % (MAX_INSTRUCTIONS - 3);
+
+   (program -> instructions) = (RAM_Instruction **)
+	   calloc (n, sizeof (RAM_Instruction *));
+   if (!(program -> instructions))
+      err_fatal_perror ("calloc", "could not allocate %d instructions", n);
+
+   (program -> n) = n;
+
+   for (k = 0; k < n; k ++)
+   {
+      RAM_Instruction *i = ram_instruction_new ();
+      unsigned long r = next_random (&state) % 32;
+
+      (program -> instructions) [k] = i;
+      (i -> parameter_type) = RAM_NO_PARAMETER;
+
+      if (r < 2)
+	 (i -> instruction) = RAM_READ;
+      else if (r < 4)
+	 (i -> instruction) = RAM_WRITE;
+      else if (r < 11)
+      {
+	 (i -> instruction) = RAM_LOAD;
+	 random_operand (&state, i, 1);
+      }
+      else if (r < 17)
+      {
+	 (i -> instruction) = RAM_STORE;
+	 random_operand (&state, i, 0);
+      }
+      else if (r < 23)
+      {
+	 (i -> instruction) = RAM_ADD;
+	 random_operand (&state, i, 1);
+      }
+      else if (r < 25)
+	 (i -> instruction) = RAM_NEG;
+      else if (r < 27)
+	 (i -> instruction) = RAM_HALF;
+      else if (r < 31)
+      {
+	 (i -> instruction) = r < 29 ? RAM_JUMP : RAM_JGTZ;
+	 (i -> parameter_type) = RAM_INSTRUCTION;
+	 mpz_init_set_ui ((i -> parameter),
+			 1 + next_random (&state) % (n + 1));
+      }
+      else
+	 (i -> instruction) = RAM_HALT;
+   }
+
+   return program;
+}
+
+
+static FILE *new_input (unsigned long seed)
+{
+   unsigned long state = ~seed;
+   unsigned int k;
+   FILE *f;
+   mpz_t value;
+
+   f = tmpfile ();
+   if (!f)
+      err_fatal_perror ("tmpfile", "could not create fuzzing input");
+
+   mpz_init (value);
+   for (k = 0; k < INPUT_VALUES; k ++)
+   {
+      random_constant (&state, value);
+      ram_tape_write (f, RAM_TAPE_BINARY, value);
+   }
+   mpz_clear (value);
+
+   rewind (f);
+
+   return f;
+}
+
+static RAM *new_machine (RAM_Program *program, unsigned long seed,
+				const RAM_Engine *engine)
+{
+   RAM *machine;
+
+   machine = ram_new_by_program (program);
+
+   (machine -> encoding) = RAM_TAPE_BINARY;
+   (machine -> input) = new_input (seed);
+   (machine -> output) = tmpfile ();
+   if (!(machine -> output))
+      err_fatal_perror ("tmpfile", "could not create fuzzing output");
+
+   if (engine -> prepare)
+      (engine -> prepare) (machine);
+
+   return machine;
+}
+
+static void delete_machine (RAM *machine)
+{
+   fclose (machine -> input);
+   fclose (machine -> output);
+
+   (machine -> program) = NULL;
+   ram_delete (machine);
+}
+
+
+typedef struct
+{
+   RAM_AVL_Node *node;
+   unsigned int offset;
+}
+RegisterCursor;
+
+/* Moves to the next written nonzero register.  Registers that were
+   written with 0 read the same as unwritten ones, and compaction is
+   free to drop them. */
+static int cursor_next (RegisterCursor *c)
+{
+   while (c -> node)
+   {
+      while ((c -> offset) < (c -> node -> size))
+      {
+	 unsigned int k = (c -> offset) ++;
+
+	 if ((c -> node -> written) [k] &&
+	     mpz_sgn ((c -> node -> segment) [k]))
+	 {
+	    (c -> offset) = k;
+	    return 1;
+	 }
+      }
+
+      (c -> node) = ram_memory_next_segment (c -> node);
+      (c -> offset) = 0;
+   }
+
+   return 0;
+}
+
+static void cursor_address (RegisterCursor *c, mpz_t address)
+{
+   mpz_add_ui (address, (c -> node -> begin), (c -> offset));
+}
+
+static const char *compare_memory (RAM_Memory *a, RAM_Memory *b,
+				mpz_t where)
+{
+   RegisterCursor ca, cb;
+   const char *what = NULL;
+   mpz_t address;
+   int more_a, more_b;
+
+   (ca.node) = ram_memory_first_segment (a);
+   (cb.node) = ram_memory_first_segment (b);
+   (ca.offset) = (cb.offset) = 0;
+
+   mpz_init (address);
+
+   for (;;)
+   {
+      more_a = cursor_next (&ca);
+      more_b = cursor_next (&cb);
+
+      if (!more_a && !more_b)
+	 break;
+
+      if (more_a && more_b)
+      {
+	 cursor_address (&ca, where);
+	 cursor_address (&cb, address);
+
+	 if (!mpz_cmp (where, address))
+	 {
+	    if (mpz_cmp ((ca.node -> segment) [ca.offset],
+			 (cb.node -> segment) [cb.offset]))
+	    {
+	       what = "register value";
+	       break;
+	    }
+
+	    (ca.offset) ++;
+	    (cb.offset) ++;
+	    continue;
+	 }
+
+	 if (mpz_cmp (address, where) < 0)
+	    mpz_set (where, address);
+      }
+      else
+	 cursor_address (more_a ? &ca : &cb, where);
+
+      what = "register set";
+      break;
+   }
+
+   mpz_clear (address);
+
+   return what;
+}
+
+static const char *compare_machines (RAM *a, RAM *b, mpz_t where)
+{
+   if ((a -> current_instruction) != (b -> current_instruction))
+      return "current instruction";
+
+   if (mpz_cmp ((a -> instructions_done), (b -> instructions_done)))
+      return "instructions done";
+
+   if (mpz_cmp ((a -> time_consumed), (b -> time_consumed)))
+      return "time consumed";
+
+   if (ftell (a -> output) != ftell (b -> output))
+      return "output length";
+
+   return compare_memory ((a -> memory), (b -> memory), where);
+}
+
+static int compare_output (RAM *a, RAM *b)
+{
+   int ca, cb;
+
+   rewind (a -> output);
+   rewind (b -> output);
+
+   do
+   {
+      ca = getc (a -> output);
+      cb = getc (b -> output);
+   }
+   while (ca == cb && ca != EOF);
+
+   return ca == cb;
+}
+
+
+static void dump_program (RAM_Program *program, FILE *report)
+{
+   unsigned int k;
+
+   for (k = 0; k < (program -> n); k ++)
+   {
+      RAM_Instruction *i = (program -> instructions) [k];
+
+      fprintf (report, "%4u  %s", k + 1,
+		      ram_instruction_names [i -> instruction]);
+
+      switch (i -> parameter_type)
+      {
+      case RAM_CONSTANT: case RAM_INSTRUCTION:
+	 gmp_fprintf (report, " %Zd", (i -> parameter));
+	 break;
+
+      case RAM_POINTER:
+	 gmp_fprintf (report, " [%Zd]", (i -> parameter));
+	 break;
+
+      case RAM_INDIRECT_POINTER:
+	 gmp_fprintf (report, " [[%Zd]]", (i -> parameter));
+	 break;
+
+      default:
+	 break;
+      }
+
+      fprintf (report, "\n");
+   }
+}
+
+static void dump_machine (RAM *machine, const RAM_Engine *engine,
+				FILE *report)
+{
+   RegisterCursor c;
+   unsigned int shown = 0;
+   mpz_t address;
+
+   gmp_fprintf (report, "%s: instruction %u, done %Zd, time %Zd, "
+		   "output %ld bytes%s\n", (engine -> name),
+		   (machine -> current_instruction) + 1,
+		   (machine -> instructions_done),
+		   (machine -> time_consumed), ftell (machine -> output),
+		   ram_is_running (machine) ? "" : ", stopped");
+
+   mpz_init (address);
+
+   (c.node) = ram_memory_first_segment (machine -> memory);
+   (c.offset) = 0;
+
+   while (cursor_next (&c))
+   {
+      if (shown ++ == DUMP_REGISTERS)
+      {
+	 fprintf (report, "   ...\n");
+	 break;
+      }
+
+      cursor_address (&c, address);
+      gmp_fprintf (report, "   [%Zd] = %Zd\n", address,
+		      (c.node -> segment) [c.offset]);
+      (c.offset) ++;
+   }
+
+   mpz_clear (address);
+}
+
+unsigned long ram_fuzz_compare_batches (RAM_Program *program,
+				unsigned long seed,
+				const RAM_Engine *reference,
+				const RAM_Engine *candidate,
+				unsigned long batch, unsigned long max_steps,
+				FILE *report, RAM_FuzzStats *stats)
+{
+   RAM *a, *b;
+   const char *what = NULL;
+   unsigned long step = 0, diverged = 0;
+   mpz_t where;
+
+   if (!batch)
+      batch = 1;
+
+   a = new_machine (program, seed, reference);
+   b = new_machine (program, seed, candidate);
+
+   mpz_init (where);
+
+   while (step < max_steps)
+   {
+      unsigned long ran_a, ran_b, n;
+
+      n = (max_steps - step < batch) ? max_steps - step : batch;
+      ran_a = (reference -> run) (a, n);
+      ran_b = (candidate -> run) (b, n);
+      step += (ran_a > ran_b) ? ran_a : ran_b;
+
+      what = compare_machines (a, b, where);
+      if (!what && ran_a != ran_b)
+	 what = "steps run";
+
+      if (what || (!ran_a && !ran_b))
+	 break;
+   }
+
+   if (!what && !compare_output (a, b))
+      what = "output contents";
+
+   if (stats)
+   {
+      (stats -> programs) ++;
+      (stats -> steps) += mpz_get_ui (a -> instructions_done);
+   }
+
+   if (what)
+   {
+      diverged = step ? step : 1;
+
+      if (stats)
+      {
+	 if (!(stats -> divergences) ++)
+	 {
+	    (stats -> failing_seed) = seed;
+	    (stats -> failing_step) = diverged;
+	 }
+      }
+
+      if (report)
+      {
+	 fprintf (report, "%s and %s diverge at step %lu of program %#lx: "
+			 "%s", (reference -> name), (candidate -> name),
+			 diverged, seed, what);
+	 if (!strncmp (what, "register", 8))
+	    gmp_fprintf (report, " at [%Zd]", where);
+	 fprintf (report, "\n");
+
+	 dump_program (program, report);
+	 dump_machine (a, reference, report);
+	 dump_machine (b, candidate, report);
+      }
+   }
+
+   mpz_clear (where);
+
+   delete_machine (a);
+   delete_machine (b);
+
+   return diverged;
+}
+
+unsigned long ram_fuzz_compare (RAM_Program *program, unsigned long seed,
+				const RAM_Engine *reference,
+				const RAM_Engine *candidate,
+				unsigned long max_steps, FILE *report,
+				RAM_FuzzStats *stats)
+{
+   return ram_fuzz_compare_batches (program, seed, reference, candidate,
+		   1, max_steps, report, stats);
+}
+
+/* Program k of a run uses seed + k, so a failing program is replayed on
+   its own by passing its seed and a count of 1. */
+unsigned long ram_fuzz (const RAM_Engine *reference,
+			const RAM_Engine *candidate, unsigned long seed,
+			unsigned long programs, unsigned long max_steps,
+			FILE *report, RAM_FuzzStats *stats)
+{
+   RAM_FuzzStats local;
+   unsigned long k;
+
+   if (!stats)
+      stats = &local;
+
+   memset (stats, 0, sizeof (RAM_FuzzStats));
+
+   for (k = 0; k < programs; k ++)
+   {
+      RAM_Program *program = ram_fuzz_program (seed + k);
+
+      if (ram_fuzz_compare (program, seed + k, reference, candidate,
+			      max_steps, report, stats))
+      {
+	 ram_program_delete (program);
+	 break;
+      }
+
+      ram_program_delete (program);
+   }
+
+   return (stats -> divergences);
+}
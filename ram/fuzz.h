@@ -0,0 +1,45 @@
+#ifndef RAM_FUZZ_H
+#define RAM_FUZZ_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <gmp.h>
+#include "ram.h"
+
+
+typedef struct
+{
+   const char *name;
+   void (*prepare) (RAM *);
+   unsigned long (*run) (RAM *, unsigned long steps);
+}
+RAM_Engine;
+
+typedef struct
+{
+   unsigned long programs, steps;
+   unsigned long divergences;
+   unsigned long failing_seed, failing_step;
+}
+RAM_FuzzStats;
+
+const RAM_Engine *ram_engine_find (const char *name);
+
+RAM_Program *ram_fuzz_program (unsigned long seed);
+
+unsigned long ram_fuzz_compare (RAM_Program *, unsigned long seed,
+				const RAM_Engine *reference,
+				const RAM_Engine *candidate,
+				unsigned long max_steps, FILE *report,
+				RAM_FuzzStats *);
+unsigned long ram_fuzz_compare_batches (RAM_Program *, unsigned long seed,
+				const RAM_Engine *reference,
+				const RAM_Engine *candidate,
+				unsigned long batch, unsigned long max_steps,
+				FILE *report, RAM_FuzzStats *);
+unsigned long ram_fuzz (const RAM_Engine *reference,
+			const RAM_Engine *candidate, unsigned long seed,
+			unsigned long programs, unsigned long max_steps,
+			FILE *report, RAM_FuzzStats *);
+
+#endif
@@ -0,0 +1,366 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <gmp.h>
+#include "heatmap.h"
+
+/* Register lookups counted through the memory access hook.  Addresses
+   are grouped in buckets of bucket_width registers, kept in an open
+   addressing table; the distance from the previous lookup is sorted
+   into stride classes.  Per segment counts are made at report time from
+   the buckets, which is exact while the bucket width divides the block
+   size, since segments start and end on block boundaries.
+
+   Pointer operands served by the machine's operand cache and register 0
+   reached through the pinned accumulator do not call ram_get_register,
+   so attaching drops the operand cache for the time the heatmap is
+   attached; the accumulator is never counted.  A memory has one set of
+   hooks, so attaching fails while perf counters are attached. */
+
+static const unsigned int HOT_BUCKETS = 16, BUSY_SEGMENTS = 16,
+			  BAR_WIDTH = 40;
+
+static const unsigned long PAGE_REGISTERS = 4096 / sizeof (mpz_t);
+
+static const char *stride_names [] =
+{
+   "same", "+1", "-1", "block", "page", "far", "wide"
+};
+
+static void grow_table (RAM_Heatmap *map)
+{
+   unsigned long *keys = (map -> keys), *counts = (map -> counts);
+   unsigned long capacity = (map -> capacity), i;
+
+   (map -> capacity) = capacity ? 2 * capacity : 1024;
+   (map -> keys) = (unsigned long *)
+	   malloc ((map -> capacity) * sizeof (unsigned long));
+   (map -> counts) = (unsigned long *)
+	   calloc ((map -> capacity), sizeof (unsigned long));
+   if (!(map -> keys) || !(map -> counts))
+      err_fatal_perror ("malloc", "could not allocate %lu heatmap buckets",
+		      (map -> capacity));
+
+   for (i = 0; i < capacity; i ++)
+      if (counts [i])
+      {
+	 unsigned long h = (keys [i] * 0x9e3779b97f4a7c15UL) &
+		 ((map -> capacity) - 1);
+
+	 while ((map -> counts) [h])
+	    h = (h + 1) & ((map -> capacity) - 1);
+
+	 (map -> keys) [h] = keys [i];
+	 (map -> counts) [h] = counts [i];
+      }
+
+   free (keys);
+   free (counts);
+}
+
+static void count_bucket (RAM_Heatmap *map, unsigned long bucket)
+{
+   unsigned long h;
+
+   if (2 * ((map -> used) + 1) > (map -> capacity))
+      grow_table (map);
+
+   h = (bucket * 0x9e3779b97f4a7c15UL) & ((map -> capacity) - 1);
+   while ((map -> counts) [h] && (map -> keys) [h] != bucket)
+      h = (h + 1) & ((map -> capacity) - 1);
+
+   if (!(map -> counts) [h])
+   {
+      (map -> keys) [h] = bucket;
+      (map -> used) ++;
+   }
+
+   (map -> counts) [h] ++;
+}
+
+static RAM_StrideClass stride_class (RAM_Memory *memory,
+				unsigned long from, unsigned long to)
+{
+   unsigned long d = to > from ? to - from : from - to;
+
+   if (!d)
+      return RAM_STRIDE_SAME;
+   if (d == 1)
+      return to > from ? RAM_STRIDE_NEXT : RAM_STRIDE_PREVIOUS;
+   if (d < (memory -> block_size))
+      return RAM_STRIDE_BLOCK;
+   if (d < PAGE_REGISTERS)
+      return RAM_STRIDE_PAGE;
+
+   return RAM_STRIDE_FAR;
+}
+
+static void memory_access (void *data, RAM_Memory *memory,
+				unsigned long address, int narrow, int hit)
+{
+   RAM_Heatmap *map = (RAM_Heatmap *) data;
+
+   (map -> lookups) ++;
+   (map -> hits) += hit;
+
+   if (!narrow)
+   {
+      (map -> wide) ++;
+      (map -> strides) [RAM_STRIDE_WIDE] ++;
+      (map -> have_last) = 0;
+      return;
+   }
+
+   if (map -> have_last)
+      (map -> strides) [stride_class (memory, (map -> last), address)] ++;
+
+   (map -> last) = address;
+   (map -> have_last) = 1;
+
+   count_bucket (map, address / (map -> bucket_width));
+}
+
+RAM_Heatmap *ram_heatmap_new (unsigned long bucket_width)
+{
+   RAM_Heatmap *map;
+
+   map = (RAM_Heatmap *) calloc (1, sizeof (RAM_Heatmap));
+   if (!map)
+      err_fatal_perror ("calloc", "could not allocate RAM_Heatmap structure");
+
+   (map -> bucket_width) = bucket_width ? bucket_width : 1;
+
+   (map -> hooks).access = memory_access;
+   (map -> hooks).data = map;
+
+   return map;
+}
+
+void ram_heatmap_delete (RAM_Heatmap *map)
+{
+   free (map -> keys);
+   free (map -> counts);
+   free (map);
+}
+
+int ram_heatmap_attach (RAM_Heatmap *map, RAM *machine)
+{
+   if ((machine -> memory -> hooks) == &(map -> hooks))
+      return 1;
+   if (machine -> memory -> hooks)
+      return 0;
+
+   (machine -> memory -> hooks) = &(map -> hooks);
+
+   (map -> machine) = machine;
+   (map -> dropped_operands) = (machine -> operands) != NULL;
+
+   free (machine -> operands);
+   (machine -> operands) = NULL;
+
+   return 1;
+}
+
+void ram_heatmap_detach (RAM_Heatmap *map, RAM *machine)
+{
+   if ((machine -> memory -> hooks) == &(map -> hooks))
+      (machine -> memory -> hooks) = NULL;
+
+   if ((map -> machine) != machine)
+      return;
+
+   if ((map -> dropped_operands) && !(machine -> operands))
+   {
+      (machine -> operands) = (RAM_OperandCache *)
+	      calloc ((machine -> program -> n), sizeof (RAM_OperandCache));
+      if ((machine -> program -> n) && !(machine -> operands))
+	 err_fatal_perror ("calloc", "could not allocate %d operand caches",
+			 (machine -> program -> n));
+   }
+
+   (map -> machine) = NULL;
+   (map -> dropped_operands) = 0;
+}
+
+
+/* Reports sort copies of the values they order by, so that two of them
+   can run at once on different threads. */
+typedef struct
+{
+   unsigned long value, index;
+}
+SortEntry;
+
+static int by_count (const void *a, const void *b)
+{
+   unsigned long ca = ((const SortEntry *) a) -> value,
+		 cb = ((const SortEntry *) b) -> value;
+
+   return ca < cb ? 1 : ca > cb ? -1 : 0;
+}
+
+static int by_key (const void *a, const void *b)
+{
+   unsigned long ka = ((const SortEntry *) a) -> value,
+		 kb = ((const SortEntry *) b) -> value;
+
+   return ka < kb ? -1 : ka > kb ? 1 : 0;
+}
+
+/* The part of a segment holding narrow addresses, if any. */
+static int segment_range (RAM_AVL_Node *node, unsigned long *first,
+				unsigned long *last)
+{
+   if (!(node -> wide))
+   {
+      (*first) = (node -> first);
+      (*last) = (node -> last);
+      return 1;
+   }
+
+   if (mpz_sgn (node -> end) < 0 || (mpz_sgn (node -> begin) >= 0 &&
+			   !mpz_fits_ulong_p (node -> begin)))
+      return 0;
+
+   (*first) = mpz_sgn (node -> begin) < 0 ? 0 : mpz_get_ui (node -> begin);
+   (*last) = mpz_fits_ulong_p (node -> end) ?
+	   mpz_get_ui (node -> end) : ULONG_MAX;
+
+   return 1;
+}
+
+static void print_bar (FILE *out, unsigned long count, unsigned long max)
+{
+   unsigned int n = max ? (unsigned int)
+	   ((double) count * BAR_WIDTH / max + 0.5) : 0;
+
+   while (n --)
+      putc ('#', out);
+   putc ('\n', out);
+}
+
+static void report_segments (RAM_Heatmap *map, RAM_Memory *memory,
+				SortEntry *order, FILE *out)
+{
+   RAM_AVL_Node *node, **nodes;
+   unsigned long *counts, i, b = 0, max = 0;
+   SortEntry *busy;
+   unsigned int n = 0, s, cold = 0;
+
+   for (node = ram_memory_first_segment (memory); node;
+	node = ram_memory_next_segment (node))
+      n ++;
+
+   nodes = (RAM_AVL_Node **) malloc (n * sizeof (RAM_AVL_Node *));
+   counts = (unsigned long *) calloc (n, sizeof (unsigned long));
+   busy = (SortEntry *) malloc (n * sizeof (SortEntry));
+   if (!nodes || !counts || !busy)
+      err_fatal_perror ("malloc", "could not allocate %u segment counts", n);
+
+   /* Buckets in address order against segments in address order. */
+   for (i = 0; i < (map -> used); i ++)
+      order [i].value = (map -> keys) [order [i].index];
+   qsort (order, (map -> used), sizeof (SortEntry), by_key);
+
+   for (s = 0, node = ram_memory_first_segment (memory); node;
+	node = ram_memory_next_segment (node), s ++)
+   {
+      unsigned long first, last;
+
+      nodes [s] = node;
+      busy [s].index = s;
+
+      if (!segment_range (node, &first, &last))
+	 continue;
+
+      while (b < (map -> used) &&
+	     order [b].value * (map -> bucket_width) < first)
+	 b ++;
+
+      while (b < (map -> used) &&
+	     order [b].value * (map -> bucket_width) <= last)
+	 counts [s] += (map -> counts) [order [b ++].index];
+   }
+
+   for (s = 0; s < n; s ++)
+   {
+      busy [s].value = counts [s];
+      cold += !counts [s];
+      if (counts [s] > max)
+	 max = counts [s];
+   }
+
+   fprintf (out, "segments: %u, %u registers allocated, %u written, "
+		   "%u never looked up\n", n, (memory -> allocated),
+		   ram_memory_written_count (memory), cold);
+
+   qsort (busy, n, sizeof (SortEntry), by_count);
+
+   for (s = 0; s < n && s < BUSY_SEGMENTS && busy [s].value; s ++)
+   {
+      node = nodes [busy [s].index];
+
+      gmp_fprintf (out, "   [%Zd, %Zd] %10lu  %5.1f%%  ", (node -> begin),
+		      (node -> end), busy [s].value,
+		      100.0 * busy [s].value / (map -> lookups));
+      print_bar (out, busy [s].value, max);
+   }
+
+   free (nodes);
+   free (counts);
+   free (busy);
+}
+
+void ram_heatmap_report (RAM_Heatmap *map, RAM_Memory *memory, FILE *out)
+{
+   unsigned long i, n = 0, max;
+   SortEntry *order;
+   unsigned int s;
+
+   fprintf (out, "heatmap: %lu lookups, %lu wide, %lu buckets of %lu "
+		   "registers, cache node hit %.1f%%\n", (map -> lookups),
+		   (map -> wide), (map -> used), (map -> bucket_width),
+		   (map -> lookups) ?
+		   100.0 * (map -> hits) / (map -> lookups) : 0.0);
+
+   if (!(map -> lookups))
+      return;
+
+   fprintf (out, "strides:");
+   for (s = 0; s < RAM_STRIDES; s ++)
+      fprintf (out, "  %s %.1f%%", stride_names [s],
+		      100.0 * (map -> strides) [s] / (map -> lookups));
+   fprintf (out, "\n");
+
+   order = (SortEntry *) malloc (((map -> used) + 1) * sizeof (SortEntry));
+   if (!order)
+      err_fatal_perror ("malloc", "could not sort %lu buckets",
+		      (map -> used));
+
+   for (i = 0; i < (map -> capacity); i ++)
+      if ((map -> counts) [i])
+      {
+	 order [n].value = (map -> counts) [i];
+	 order [n ++].index = i;
+      }
+
+   qsort (order, n, sizeof (SortEntry), by_count);
+
+   max = n ? order [0].value : 0;
+   for (i = 0; i < n && i < HOT_BUCKETS; i ++)
+   {
+      unsigned long k = order [i].index, start;
+
+      start = (map -> keys) [k] * (map -> bucket_width);
+      fprintf (out, "   [%lu, %lu] %10lu  %5.1f%%  ", start,
+		      start + (map -> bucket_width) - 1, (map -> counts) [k],
+		      100.0 * (map -> counts) [k] / (map -> lookups));
+      print_bar (out, (map -> counts) [k], max);
+   }
+
+   if (memory)
+      report_segments (map, memory, order, out);
+
+   free (order);
+}
@@ -0,0 +1,49 @@
+#ifndef RAM_HEATMAP_H
+#define RAM_HEATMAP_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "ram.h"
+
+
+typedef enum
+{
+   RAM_STRIDE_SAME = 0,
+   RAM_STRIDE_NEXT,
+   RAM_STRIDE_PREVIOUS,
+   RAM_STRIDE_BLOCK,
+   RAM_STRIDE_PAGE,
+   RAM_STRIDE_FAR,
+   RAM_STRIDE_WIDE,
+   RAM_STRIDES
+}
+RAM_StrideClass;
+
+typedef struct
+{
+   unsigned long bucket_width;
+
+   unsigned long *keys, *counts;
+   unsigned long capacity, used;
+
+   unsigned long lookups, hits, wide;
+   unsigned long strides [RAM_STRIDES];
+   unsigned long last;
+   int have_last;
+
+   RAM *machine;
+   int dropped_operands;
+
+   RAM_MemoryHooks hooks;
+}
+RAM_Heatmap;
+
+RAM_Heatmap *ram_heatmap_new (unsigned long bucket_width);
+void ram_heatmap_delete (RAM_Heatmap *);
+
+int ram_heatmap_attach (RAM_Heatmap *, RAM *);
+void ram_heatmap_detach (RAM_Heatmap *, RAM *);
+
+void ram_heatmap_report (RAM_Heatmap *, RAM_Memory *, FILE *);
+
+#endif
@@ -0,0 +1,192 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "kernels.h"
+
+#if defined (__x86_64__) || defined (__i386__)
+#include <immintrin.h>
+#define X86_KERNELS
+#endif
+
+/* Scans over the per-segment written maps.  Most registers of a large
+   segment are never touched, so reset, delete and snapshot time is
+   spent skipping zero bytes; the vector versions test 16 or 32 map
+   bytes at a time.  The best level the CPU supports is picked at
+   startup, ram_kernels_select can force a lower one. */
+
+typedef unsigned int NextSetKernel (const unsigned char *, unsigned int,
+				unsigned int);
+typedef unsigned int CountSetKernel (const unsigned char *, unsigned int);
+
+static unsigned int next_set_scalar (const unsigned char *map,
+				unsigned int from, unsigned int size)
+{
+   while (from < size && (from % sizeof (unsigned long)))
+   {
+      if (map [from])
+	 return from;
+      from ++;
+   }
+
+   for (; from + sizeof (unsigned long) <= size;
+		   from += sizeof (unsigned long))
+   {
+      unsigned long word;
+
+      memcpy (&word, map + from, sizeof (unsigned long));
+      if (word)
+	 break;
+   }
+
+   while (from < size && !map [from])
+      from ++;
+
+   return from < size ? from : size;
+}
+
+static unsigned int count_set_scalar (const unsigned char *map,
+				unsigned int size)
+{
+   unsigned int i, count = 0;
+
+   for (i = 0; i < size; i ++)
+      count += map [i];
+
+   return count;
+}
+
+#ifdef X86_KERNELS
+
+__attribute__ ((target ("sse2")))
+static unsigned int next_set_sse2 (const unsigned char *map,
+				unsigned int from, unsigned int size)
+{
+   const __m128i zero = _mm_setzero_si128 ();
+
+   for (; from + 16 <= size; from += 16)
+   {
+      __m128i v = _mm_loadu_si128 ((const __m128i *) (map + from));
+      unsigned int mask =
+	      _mm_movemask_epi8 (_mm_cmpeq_epi8 (v, zero)) ^ 0xffff;
+
+      if (mask)
+	 return from + __builtin_ctz (mask);
+   }
+
+   return next_set_scalar (map, from, size);
+}
+
+__attribute__ ((target ("sse2")))
+static unsigned int count_set_sse2 (const unsigned char *map,
+				unsigned int size)
+{
+   const __m128i zero = _mm_setzero_si128 ();
+   __m128i sum = zero;
+   unsigned int i;
+
+   for (i = 0; i + 16 <= size; i += 16)
+      sum = _mm_add_epi64 (sum, _mm_sad_epu8 (_mm_loadu_si128
+			      ((const __m128i *) (map + i)), zero));
+
+   return (unsigned int) (_mm_cvtsi128_si32 (sum) +
+	   _mm_cvtsi128_si32 (_mm_unpackhi_epi64 (sum, sum))) +
+	   count_set_scalar (map + i, size - i);
+}
+
+__attribute__ ((target ("avx2")))
+static unsigned int next_set_avx2 (const unsigned char *map,
+				unsigned int from, unsigned int size)
+{
+   const __m256i zero = _mm256_setzero_si256 ();
+
+   for (; from + 32 <= size; from += 32)
+   {
+      __m256i v = _mm256_loadu_si256 ((const __m256i *) (map + from));
+      unsigned int mask =
+	      ~ (unsigned int) _mm256_movemask_epi8 (_mm256_cmpeq_epi8 (v, zero));
+
+      if (mask)
+	 return from + __builtin_ctz (mask);
+   }
+
+   return next_set_sse2 (map, from, size);
+}
+
+__attribute__ ((target ("avx2")))
+static unsigned int count_set_avx2 (const unsigned char *map,
+				unsigned int size)
+{
+   const __m256i zero = _mm256_setzero_si256 ();
+   __m256i sum = zero;
+   __m128i half;
+   unsigned int i;
+
+   for (i = 0; i + 32 <= size; i += 32)
+      sum = _mm256_add_epi64 (sum, _mm256_sad_epu8 (_mm256_loadu_si256
+			      ((const __m256i *) (map + i)), zero));
+
+   half = _mm_add_epi64 (_mm256_castsi256_si128 (sum),
+		   _mm256_extracti128_si256 (sum, 1));
+
+   return (unsigned int) (_mm_cvtsi128_si32 (half) +
+	   _mm_cvtsi128_si32 (_mm_unpackhi_epi64 (half, half))) +
+	   count_set_sse2 (map + i, size - i);
+}
+
+#endif
+
+static NextSetKernel *next_set = next_set_scalar;
+static CountSetKernel *count_set = count_set_scalar;
+static RAM_KernelLevel level = RAM_KERNEL_SCALAR;
+
+static const char *level_names [] = { "scalar", "sse2", "avx2" };
+
+RAM_KernelLevel ram_kernels_select (RAM_KernelLevel wanted)
+{
+   level = RAM_KERNEL_SCALAR;
+   next_set = next_set_scalar;
+   count_set = count_set_scalar;
+
+#ifdef X86_KERNELS
+   __builtin_cpu_init ();
+
+   if (wanted >= RAM_KERNEL_SSE2 && __builtin_cpu_supports ("sse2"))
+   {
+      level = RAM_KERNEL_SSE2;
+      next_set = next_set_sse2;
+      count_set = count_set_sse2;
+   }
+
+   if (wanted >= RAM_KERNEL_AVX2 && __builtin_cpu_supports ("avx2"))
+   {
+      level = RAM_KERNEL_AVX2;
+      next_set = next_set_avx2;
+      count_set = count_set_avx2;
+   }
+#endif
+
+   return level;
+}
+
+__attribute__ ((constructor))
+static void select_best_kernels ()
+{
+   ram_kernels_select (RAM_KERNEL_AVX2);
+}
+
+const char *ram_kernels_name ()
+{
+   return level_names [level];
+}
+
+unsigned int ram_kernel_next_set (const unsigned char *map,
+				unsigned int from, unsigned int size)
+{
+   return next_set (map, from, size);
+}
+
+unsigned int ram_kernel_count_set (const unsigned char *map,
+				unsigned int size)
+{
+   return count_set (map, size);
+}
@@ -0,0 +1,22 @@
+#ifndef RAM_KERNELS_H
+#define RAM_KERNELS_H
+
+#include <stdio.h>
+#include <stdlib.h>
+
+
+typedef enum
+{
+   RAM_KERNEL_SCALAR = 0, RAM_KERNEL_SSE2, RAM_KERNEL_AVX2
+}
+RAM_KernelLevel;
+
+RAM_KernelLevel ram_kernels_select (RAM_KernelLevel);
+const char *ram_kernels_name ();
+
+unsigned int ram_kernel_next_set (const unsigned char *map,
+				unsigned int from, unsigned int size);
+unsigned int ram_kernel_count_set (const unsigned char *map,
+				unsigned int size);
+
+#endif
@@ -2,16 +2,26 @@
 #include <stdlib.h>
 #include <string.h>
 #include <gmp.h>
+#include "usage.h"
+#include "kernels.h"
 
 
 
 static unsigned int block_size = 4;
+static RAM_SegmentIndexType segment_index = RAM_INDEX_AVL;
+
+static const long REGISTER_BYTES = sizeof (mpz_t) + 1;
 
 void ram_set_block_size (unsigned int size)
 {
    block_size = size;
 }
 
+void ram_set_segment_index (RAM_SegmentIndexType type)
+{
+   segment_index = type;
+}
+
 static void inline align_size (RAM_Memory *memory, unsigned int *size)
 {
    if (*size % (memory -> block_size))
@@ -35,6 +45,52 @@ static void inline align_block_start (RAM_Memory *memory, mpz_t *start)
    mpz_clear (r);
 }
 
+/* Segments are keyed by native words as well as by their mpz bounds.
+   Nearly every address fits in an unsigned long, and for those the tree
+   descent and the offset into a segment are plain integer arithmetic.
+   A segment reaching below 0 or past ULONG_MAX is wide and, like an
+   address outside that range, goes through GMP; both kinds live in the
+   same tree, so merging and iteration do not care about the boundary. */
+
+typedef struct
+{
+   unsigned long value;
+   int wide;
+   mpz_t *address;
+}
+Key;
+
+static inline void make_key (Key *key, mpz_t *addr)
+{
+   (key -> address) = addr;
+   (key -> wide) = mpz_sgn (*addr) < 0 || !mpz_fits_ulong_p (*addr);
+   (key -> value) = (key -> wide) ? 0 : mpz_get_ui (*addr);
+}
+
+static inline void set_keys (RAM_AVL_Node *node)
+{
+   (node -> wide) = mpz_sgn (node -> begin) < 0 ||
+	   !mpz_fits_ulong_p (node -> end);
+   (node -> first) = (node -> wide) ? 0 : mpz_get_ui (node -> begin);
+   (node -> last) = (node -> wide) ? 0 : mpz_get_ui (node -> end);
+}
+
+static inline int key_before (RAM_AVL_Node *node, Key *key)
+{
+   if (!((node -> wide) | (key -> wide)))
+      return (key -> value) < (node -> first);
+
+   return mpz_cmp (*(key -> address), (node -> begin)) < 0;
+}
+
+static inline int key_after (RAM_AVL_Node *node, Key *key)
+{
+   if (!((node -> wide) | (key -> wide)))
+      return (key -> value) > (node -> last);
+
+   return mpz_cmp (*(key -> address), (node -> end)) > 0;
+}
+
 static RAM_AVL_Node *avl_node_new ()
 {
    RAM_AVL_Node *node = (RAM_AVL_Node *) calloc (1, sizeof (RAM_AVL_Node));
@@ -42,6 +98,8 @@ static RAM_AVL_Node *avl_node_new ()
       err_fatal_perror ("calloc",
 		      "could not allocate RAM_AVL_Node structure");
 
+   ram_usage_add (RAM_USAGE_NODES, sizeof (RAM_AVL_Node));
+
    mpz_init (node -> begin);
    mpz_init (node -> end);
    
@@ -58,28 +116,41 @@ static RAM_AVL_Node *avl_node_new_for_segment (RAM_Memory *memory,
    mpz_set ((node -> begin), base);
    mpz_add_ui ((node -> end), (node -> begin), size - 1);
    (node -> size) = size;
+   set_keys (node);
 
    (node -> segment) = (mpz_t *) malloc (size * sizeof (mpz_t));
-   if (!(node -> segment))
+   (node -> written) = (unsigned char *) calloc (size, 1);
+   if (!(node -> segment) || !(node -> written))
       err_fatal_perror ("malloc",
 		"could not allocate memory for %d registers segment", size);
 
-   {
-      unsigned int i;
-      for (i = 0; i < size; i ++)
-	 mpz_init ((node -> segment) [i]);
-   }
+   ram_usage_add (RAM_USAGE_SEGMENTS, size * REGISTER_BYTES);
 
    return node;
 }
 
-static inline void segment_delete (RAM_AVL_Node *node)
+static void clear_registers (RAM_AVL_Node *node, unsigned int from,
+				unsigned int to)
 {
    unsigned int i;
-   for (i = 0;  i < (node -> size);  i ++)
+
+   for (i = ram_kernel_next_set ((node -> written), from, to); i < to;
+		   i = ram_kernel_next_set ((node -> written), i + 1, to))
+   {
       mpz_clear ((node -> segment) [i]);
+      (node -> written) [i] = 0;
+   }
+}
+
+static inline void segment_delete (RAM_AVL_Node *node)
+{
+   clear_registers (node, 0, (node -> size));
 
    free (node -> segment);
+   free (node -> written);
+
+   ram_usage_add (RAM_USAGE_SEGMENTS,
+		   - (long) (node -> size) * REGISTER_BYTES);
 }
 
 static void avl_node_delete (RAM_AVL_Node *node)
@@ -91,6 +162,8 @@ static void avl_node_delete (RAM_AVL_Node *node)
    mpz_clear (node -> end);
    
    free (node);
+
+   ram_usage_add (RAM_USAGE_NODES, - (long) sizeof (RAM_AVL_Node));
 }
 
 static void avl_tree_delete (RAM_AVL_Node *tree)
@@ -122,8 +195,12 @@ static void avl_tree_delete (RAM_AVL_Node *tree)
 
 void ram_memory_delete (RAM_Memory *rm)
 {
+   ram_memory_set_segment_index (rm, RAM_INDEX_AVL);
    avl_tree_delete (rm -> root);
+   ram_arena_delete (rm -> arena);
    free (rm);
+
+   ram_usage_add (RAM_USAGE_NODES, - (long) sizeof (RAM_Memory));
 }
 
 RAM_Memory *ram_memory_new ()
@@ -133,7 +210,12 @@ RAM_Memory *ram_memory_new ()
       err_fatal_perror ("calloc", 
 		      "could not allocate memory for RAM_Memory structure");
 
+   ram_usage_add (RAM_USAGE_NODES, sizeof (RAM_Memory));
+
    (rm -> block_size) = block_size;
+   (rm -> generation) = 1;
+   (rm -> arena) = ram_arena_new ();
+   ram_memory_set_segment_index (rm, segment_index);
 
    {
       mpz_t base;
@@ -141,6 +223,8 @@ RAM_Memory *ram_memory_new ()
       mpz_init_set_ui (base, 0);
       (rm -> root) = avl_node_new_for_segment (rm, base, 1);
       (rm -> begin) = (rm -> root);
+      mpz_init (rm -> begin -> segment [0]);
+      (rm -> begin -> written [0]) = 1;
       (rm -> allocated) = (rm -> root -> size);
       (rm -> segment_count) = 1;
 
@@ -155,21 +239,22 @@ static void inline do_resize_segment (RAM_AVL_Node *node, unsigned int size)
 {
    (node -> segment) = (mpz_t *) realloc ((node -> segment),
 					  sizeof (mpz_t) * size);
-   if (! (node -> segment))
+   (node -> written) = (unsigned char *) realloc ((node -> written), size);
+   if (! (node -> segment) || ! (node -> written))
       err_fatal_perror ("realloc",
 		"could not resize memory block (old size %d, new size %d)",
 		(node -> size), size);
 
+   ram_usage_add (RAM_USAGE_SEGMENTS,
+		   ((long) size - (long) (node -> size)) * REGISTER_BYTES);
    (node -> size) = size;
    mpz_add_ui ((node -> end), (node -> begin), size - 1);
+   set_keys (node);
 }
 
 static void shrink_segment (RAM_AVL_Node *node, unsigned int size)
 {
-   unsigned int i;
-
-   for (i = size; i < (node -> size); i ++)
-      mpz_clear ((node -> segment) [i]);
+   clear_registers (node, size, (node -> size));
    
    do_resize_segment (node, size);
 }
@@ -179,12 +264,7 @@ static inline void expand_segment (RAM_AVL_Node *node, unsigned int size)
    unsigned int old_size = (node -> size);
 
    do_resize_segment (node, size);
-   {
-      unsigned int i;
-
-      for (i = old_size; i < size; i ++)
-	 mpz_init ((node -> segment) [i]);
-   }
+   memset ((node -> written) + old_size, 0, size - old_size);
 }
 
 static inline void expand_segment_backwards (RAM_AVL_Node *node,
@@ -196,32 +276,40 @@ static inline void expand_segment_backwards (RAM_AVL_Node *node,
    do_resize_segment (node, size);
    memmove ((node -> segment) + diff, (node -> segment),
 		   (size - diff) * sizeof (mpz_t));
-   {
-      unsigned int i;
-
-      for (i = 0; i < diff; i ++)
-	 mpz_init ((node -> segment) [i]);
-   }
+   memmove ((node -> written) + diff, (node -> written), size - diff);
+   memset ((node -> written), 0, diff);
 }
 
-static inline mpz_t *find_register (RAM_AVL_Node *node, mpz_t *addr)
+static inline mpz_t *find_register (RAM_AVL_Node *node, Key *key)
 {
-   mpz_t offset, *r;
+   unsigned long i;
+   mpz_t *r;
 
-   mpz_init_set (offset, *addr);
-   mpz_sub (offset, offset, (node -> begin));
+   if (!((node -> wide) | (key -> wide)))
+      i = (key -> value) - (node -> first);
+   else
+   {
+      mpz_t offset;
 
-   r = (node -> segment) + mpz_get_ui (offset);
+      mpz_init (offset);
+      mpz_sub (offset, *(key -> address), (node -> begin));
+      i = mpz_get_ui (offset);
+      mpz_clear (offset);
+   }
 
-   mpz_clear (offset);
+   r = (node -> segment) + i;
+   if (! (node -> written) [i])
+   {
+      mpz_init (*r);
+      (node -> written) [i] = 1;
+   }
 
    return r;
 }
 
-static inline int segment_contains (RAM_AVL_Node *node, mpz_t *addr)
+static inline int segment_contains (RAM_AVL_Node *node, Key *key)
 {
-   return (mpz_cmp (*addr, (node -> begin)) < 0 ||
-		   mpz_cmp (*addr, (node -> end)) > 0) ? 0 : 1;
+   return (key_before (node, key) || key_after (node, key)) ? 0 : 1;
 }
 
 
@@ -260,19 +348,199 @@ static void remove_all_but_begin (RAM_Memory *rm)
    (rm -> cache) = (rm -> begin);
 }
 
-static RAM_AVL_Node *find_segment (RAM_Memory *rm, mpz_t *addr)
+/* The B+-tree index is a static implicit tree over the native first
+   keys of the segments: every level holds each INDEX_FANOUT-th key of
+   the level below, and a lookup scans one block of keys per level
+   instead of following a pointer per AVL level.  The AVL tree remains
+   the authority.  A segment added since the last build is just missing
+   from the index and found by the usual descent, while a removed one
+   makes the index unusable; in both cases it is rebuilt once enough
+   lookups have gone past it to pay for the rebuild. */
+
+#define INDEX_FANOUT 16
+#define INDEX_LEVELS 16
+
+struct _RAM_SegmentIndex
+{
+   unsigned long *keys;
+   RAM_AVL_Node **nodes;
+   unsigned int capacity, count, levels;
+   unsigned int offset [INDEX_LEVELS], size [INDEX_LEVELS];
+   int valid;
+   unsigned int inserted, lookups;
+};
+
+static RAM_AVL_Node *avl_first (RAM_AVL_Node *);
+static RAM_AVL_Node *avl_next (RAM_AVL_Node *);
+
+static inline long index_bytes (unsigned int capacity)
+{
+   return (long) capacity * (sizeof (RAM_AVL_Node *) +
+		   sizeof (unsigned long)) +
+	   (long) (capacity / (INDEX_FANOUT - 1) +
+		   (INDEX_FANOUT + 1) * INDEX_LEVELS) * sizeof (unsigned long);
+}
+
+static void index_build (RAM_Memory *memory)
+{
+   RAM_SegmentIndex *index = (memory -> index);
+   RAM_AVL_Node *node;
+   unsigned int n = 0, total = 0, level, size, i;
+
+   if ((index -> capacity) < (memory -> segment_count))
+   {
+      unsigned int capacity = (memory -> segment_count) +
+	      (memory -> segment_count) / 2 + INDEX_FANOUT;
+      void *keys;
+
+      free (index -> nodes);
+      free (index -> keys);
+      ram_usage_add (RAM_USAGE_NODES, index_bytes (capacity) -
+		      ((index -> capacity) ? index_bytes (index -> capacity) : 0));
+
+      (index -> nodes) = (RAM_AVL_Node **)
+	      malloc (capacity * sizeof (RAM_AVL_Node *));
+      if (!(index -> nodes) || posix_memalign (&keys, 64,
+			      index_bytes (capacity) -
+			      capacity * sizeof (RAM_AVL_Node *)))
+	 err_fatal_perror ("malloc",
+			 "could not allocate index for %d segments", capacity);
+
+      (index -> keys) = (unsigned long *) keys;
+      (index -> capacity) = capacity;
+   }
+
+   for (node = avl_first (memory -> root); node; node = avl_next (node))
+      if (!(node -> wide))
+	 (index -> nodes) [n ++] = node;
+
+   size = n;
+   level = 0;
+   do
+   {
+      (index -> offset) [level] = total;
+      (index -> size) [level] = size;
+      total += (size + INDEX_FANOUT - 1) / INDEX_FANOUT * INDEX_FANOUT;
+      size = (size + INDEX_FANOUT - 1) / INDEX_FANOUT;
+      level ++;
+   }
+   while ((index -> size) [level - 1] > INDEX_FANOUT);
+   (index -> levels) = level;
+
+   for (i = 0; i < n; i ++)
+      (index -> keys) [i] = (index -> nodes) [i] -> first;
+   for (level = 1; level < (index -> levels); level ++)
+      for (i = 0; i < (index -> size) [level]; i ++)
+	 (index -> keys) [(index -> offset) [level] + i] =
+		 (index -> keys) [(index -> offset) [level - 1] +
+		 i * INDEX_FANOUT];
+
+   (index -> count) = n;
+   (index -> valid) = 1;
+   (index -> inserted) = 0;
+   (index -> lookups) = 0;
+}
+
+static inline RAM_AVL_Node *index_search (RAM_SegmentIndex *index,
+						unsigned long value)
+{
+   unsigned int level = (index -> levels), p = 0;
+
+   while (level --)
+   {
+      const unsigned long *keys = (index -> keys) +
+	      (index -> offset) [level] + p * INDEX_FANOUT;
+      unsigned int end = (index -> size) [level] - p * INDEX_FANOUT,
+		   j, below = 0;
+
+      if (end > INDEX_FANOUT)
+	 end = INDEX_FANOUT;
+      for (j = 0; j < end; j ++)
+	 below += (keys [j] <= value);
+
+      if (!below)
+	 return NULL;
+      p = p * INDEX_FANOUT + below - 1;
+   }
+
+   return (index -> nodes) [p];
+}
+
+static RAM_AVL_Node *index_find (RAM_Memory *memory, Key *key)
+{
+   RAM_SegmentIndex *index = (memory -> index);
+   RAM_AVL_Node *node;
+
+   if (!index || (key -> wide))
+      return NULL;
+
+   if (!(index -> valid) || (index -> inserted) > (index -> count) / 8)
+   {
+      if (++ (index -> lookups) <
+		      (memory -> segment_count) / 4 + INDEX_FANOUT)
+	 return NULL;
+
+      index_build (memory);
+   }
+
+   node = index_search (index, (key -> value));
+   if (!node || (node -> wide) || (key -> value) > (node -> last))
+      return NULL;
+
+   return node;
+}
+
+static inline void index_invalidate (RAM_Memory *memory)
+{
+   if (memory -> index)
+      (memory -> index -> valid) = 0;
+}
+
+void ram_memory_set_segment_index (RAM_Memory *memory,
+				RAM_SegmentIndexType type)
+{
+   RAM_SegmentIndex *index = (memory -> index);
+
+   if (type == RAM_INDEX_BTREE && !index)
+   {
+      (memory -> index) = (RAM_SegmentIndex *)
+	      calloc (1, sizeof (RAM_SegmentIndex));
+      if (!(memory -> index))
+	 err_fatal_perror ("calloc",
+			 "could not allocate RAM_SegmentIndex structure");
+   }
+   else if (type == RAM_INDEX_AVL && index)
+   {
+      if (index -> capacity)
+	 ram_usage_add (RAM_USAGE_NODES, - index_bytes (index -> capacity));
+
+      free (index -> nodes);
+      free (index -> keys);
+      free (index);
+      (memory -> index) = NULL;
+   }
+}
+
+static RAM_AVL_Node *find_segment (RAM_Memory *rm, Key *key)
 {
    RAM_AVL_Node *node;
    
    if (rm -> cache)
-      if (segment_contains ((rm -> cache), addr))
+      if (segment_contains ((rm -> cache), key))
 	 return (rm -> cache);
+
+   node = index_find (rm, key);
+   if (node)
+   {
+      (rm -> cache) = node;
+      return node;
+   }
    
    node = (rm -> root);
    while (node)
-      if (mpz_cmp ((node -> begin), *addr) > 0)
+      if (key_before (node, key))
          node = (node -> left);
-      else if (mpz_cmp ((node -> end), *addr) < 0)
+      else if (key_after (node, key))
 	 node = (node -> right);
       else
       {
@@ -284,21 +552,29 @@ static RAM_AVL_Node *find_segment (RAM_Memory *rm, mpz_t *addr)
 }
 
 
-static RAM_AVL_Node *try_to_find_segment (RAM_Memory *rm, mpz_t *addr,
+static RAM_AVL_Node *try_to_find_segment (RAM_Memory *rm, Key *key,
 					int *position)
 {
    RAM_AVL_Node *node;
    
    if (rm -> cache)
-      if (segment_contains ((rm -> cache), addr))
+      if (segment_contains ((rm -> cache), key))
       {
 	 *position = 0;
 	 return (rm -> cache);
       }
 
+   node = index_find (rm, key);
+   if (node)
+   {
+      (*position) = 0;
+      (rm -> cache) = node;
+      return node;
+   }
+
    node = (rm -> root);
    while (node)
-      if (mpz_cmp ((node -> begin), *addr) > 0)
+      if (key_before (node, key))
       {
 	 if (! (node -> left))
 	 {
@@ -308,7 +584,7 @@ static RAM_AVL_Node *try_to_find_segment (RAM_Memory *rm, mpz_t *addr,
 	 
          node = (node -> left);
       }
-      else if (mpz_cmp ((node -> end), *addr) < 0)
+      else if (key_after (node, key))
       {
 	 if (! (node -> right))
 	 {
@@ -327,50 +603,51 @@ static RAM_AVL_Node *try_to_find_segment (RAM_Memory *rm, mpz_t *addr,
    return NULL;	
 }
 
-static inline int segment_is_left_to (RAM_AVL_Node *node, mpz_t *addr,
+static inline int segment_is_left_to (RAM_AVL_Node *node, Key *key,
 						unsigned int size)
 {
    mpz_t one_block_after;
    int result;
 
+   if (!((node -> wide) | (key -> wide)))
+      return (key -> value) - (node -> last) <= size;
+
    mpz_init (one_block_after);
    mpz_add_ui (one_block_after, (node -> end), size);
-   result = (mpz_cmp (*addr, one_block_after) <= 0);
+   result = (mpz_cmp (*(key -> address), one_block_after) <= 0);
    mpz_clear (one_block_after);
 
    return result;
 }
 
 
-static inline int segment_is_right_to (RAM_AVL_Node *node, mpz_t *addr,
+static inline int segment_is_right_to (RAM_AVL_Node *node, Key *key,
 						unsigned int size)
 {
    mpz_t one_block_before;
    int result;
 
+   if (!((node -> wide) | (key -> wide)))
+      return (node -> first) - (key -> value) <= size;
+
    mpz_init (one_block_before);
    mpz_sub_ui (one_block_before, (node -> begin), size);
-   result = (mpz_cmp (*addr, one_block_before) >= 0);
+   result = (mpz_cmp (*(key -> address), one_block_before) >= 0);
    mpz_clear (one_block_before);
 
    return result;
 }
 
 static inline RAM_AVL_Node *try_to_find_prev_segment
-		(RAM_AVL_Node *node, mpz_t *addr, unsigned int size)
+		(RAM_AVL_Node *node, Key *key, unsigned int size)
 {
-   if (node -> left)
-      return segment_is_left_to ((node -> left), addr, size) ?
-	 (node -> left) : NULL;
-
-   if (mpz_cmp ((node -> end), *addr) < 0)
-      if (segment_is_left_to (node, addr, size))
-         return node;
+   if (key_after (node, key))
+      return segment_is_left_to (node, key, size) ? node : NULL;
 
    while (node -> up)
    {
       if ((node -> up -> right) == node)
-	 return segment_is_left_to ((node -> up), addr, size) ?
+	 return segment_is_left_to ((node -> up), key, size) ?
 		 (node -> up) : NULL;
 
       node = (node -> up);
@@ -381,20 +658,15 @@ static inline RAM_AVL_Node *try_to_find_prev_segment
 
 
 static inline RAM_AVL_Node *try_to_find_next_segment
-		(RAM_AVL_Node *node, mpz_t *addr, unsigned int size)
+		(RAM_AVL_Node *node, Key *key, unsigned int size)
 {
-   if (node -> right)
-      return segment_is_right_to ((node -> left), addr, size) ?
-	 (node -> right) : NULL;
-
-   if (mpz_cmp ((node -> begin), *addr) > 0)
-      if (segment_is_right_to (node, addr, size))
-         return node;
+   if (key_before (node, key))
+      return segment_is_right_to (node, key, size) ? node : NULL;
 
    while (node -> up)
    {
       if ((node -> up -> left) == node)
-	 return segment_is_right_to ((node -> up), addr, size) ?
+	 return segment_is_right_to ((node -> up), key, size) ?
 		 (node -> up) : NULL;
 
       node = (node -> up);
@@ -409,8 +681,10 @@ static inline RAM_AVL_Node *avl_balance (RAM_AVL_Node **root,
    RAM_AVL_Node *next = ((node -> balance) > 0) ? 
 	   		(node -> right) : (node -> left);
       
-   if ((node -> balance) * (next -> balance) > 0)
+   if ((node -> balance) * (next -> balance) >= 0)
    {
+      int heavy = (next -> balance) ? 0 : (node -> balance);
+
       (next -> up) = (node -> up);
       (node -> up) = next;
   
@@ -438,8 +712,8 @@ static inline RAM_AVL_Node *avl_balance (RAM_AVL_Node **root,
 	 *this = next;
       }
 
-      (node -> balance) = 0;
-      (next -> balance) = 0;
+      (node -> balance) = heavy;
+      (next -> balance) = -heavy;
 
       if (node == *root)
          *root = next;
@@ -474,7 +748,7 @@ static inline RAM_AVL_Node *avl_balance (RAM_AVL_Node **root,
 	 (third -> right) = next;
 
 	 (node -> balance) = ((third -> balance) <= 0) ? 0 : -1;
-	 (next -> balance) = ((third -> balance) >= 0) ? 0 : -1;
+	 (next -> balance) = ((third -> balance) >= 0) ? 0 : 1;
       }
       else
       {
@@ -490,7 +764,7 @@ static inline RAM_AVL_Node *avl_balance (RAM_AVL_Node **root,
 	 (third -> right) = node;
 
      	 (next -> balance) = ((third -> balance) <= 0) ? 0 : -1;
-	 (node -> balance) = ((third -> balance) >= 0) ? 0 : -1;
+	 (node -> balance) = ((third -> balance) >= 0) ? 0 : 1;
       }
 
       (node -> up) = third;
@@ -558,28 +832,24 @@ static void avl_delete (RAM_AVL_Node **root, RAM_AVL_Node *node)
 	    while (prev -> left)
 	       prev = (prev -> left);
 
-	    (prev -> left) = (node -> left);
-	    (node -> left -> up) = prev;
-
-	    (prev -> right) = (node -> right);
-	    (node -> right -> up) = prev;
+	    dp = (prev -> up);
+	    side = -1;
 
-	    (prev -> up -> left) = (prev -> right);
+	    (dp -> left) = (prev -> right);
 	    if (prev -> right)
-	       (prev -> right -> up) = (prev -> up);
+	       (prev -> right -> up) = dp;
 
-	    dp = (prev -> up);
-	    side = -1;
+	    (prev -> right) = (node -> right);
+	    (node -> right -> up) = prev;
 	 }
 	 else
 	 {
-	    (prev -> left) = (node -> left);
-	    if (node -> left)
-	       (node -> left -> up) = prev;
-	   
 	    dp = prev;
 	    side = 1;
 	 }
+
+	 (prev -> left) = (node -> left);
+	 (node -> left -> up) = prev;
       }
       else
       {
@@ -589,29 +859,27 @@ static void avl_delete (RAM_AVL_Node **root, RAM_AVL_Node *node)
 	    while (prev -> right)
 	       prev = (prev -> right);
 
-	    (prev -> right) = (node -> right);
-	    (node -> right -> up) = prev;
-
-	    (prev -> left) = (node -> left);
-	    (node -> left -> up) = prev;
+	    dp = (prev -> up);
+	    side = 1;
 
-	    (prev -> up -> right) = (prev -> left);
+	    (dp -> right) = (prev -> left);
 	    if (prev -> left)
-	       (prev -> left -> up) = (prev -> up);
+	       (prev -> left -> up) = dp;
 
-	    dp = (prev -> up);
-	    side = 1;
+	    (prev -> left) = (node -> left);
+	    (node -> left -> up) = prev;
 	 }
 	 else
 	 {
-	    (prev -> right) = (node -> right);
-	    if (node -> right)
-	       (node -> right -> up) = prev;
-	   
 	    dp = prev;
 	    side = -1;
 	 }
+
+	 (prev -> right) = (node -> right);
+	 (node -> right -> up) = prev;
       }
+
+      (prev -> balance) = (node -> balance);
    }
    else
    {
@@ -645,12 +913,13 @@ static void avl_delete (RAM_AVL_Node **root, RAM_AVL_Node *node)
    {
       int factor = (dp -> balance) * side;
       if (factor > 0)
-      {
 	 (dp -> balance) = 0;
-	 break;
-      }
       else if (factor < 0)
+      {
 	 dp = avl_balance (root, dp);
+	 if (dp -> balance)
+	    break;
+      }
       else
       {
 	 (dp -> balance) = -side;
@@ -665,124 +934,381 @@ static void avl_delete (RAM_AVL_Node **root, RAM_AVL_Node *node)
 }
 
 
-static void merge_segments (RAM_Memory *memory,
-		RAM_AVL_Node *left, RAM_AVL_Node *right)
+static void join_segments (RAM_AVL_Node *left, RAM_AVL_Node *right,
+					unsigned int gap)
 {
    unsigned int left_size = (left -> size);
 
-   do_resize_segment (left, left_size + (right -> size) +
-		   		(memory -> block_size));
-   memcpy ((left -> segment) + left_size + (memory -> block_size),
+   do_resize_segment (left, left_size + gap + (right -> size));
+   memcpy ((left -> segment) + left_size + gap,
 		   (right -> segment), (right -> size) * sizeof (mpz_t));
+   memcpy ((left -> written) + left_size + gap,
+		   (right -> written), (right -> size));
+   memset ((left -> written) + left_size, 0, gap);
+   (left -> dirty) |= (right -> dirty);
    free (right -> segment);
+   free (right -> written);
+   ram_usage_add (RAM_USAGE_SEGMENTS,
+		   - (long) (right -> size) * REGISTER_BYTES);
    (right -> size) = 0;
    (right -> segment) = 0;
-   avl_delete (&(memory -> root), right);
+   (right -> written) = 0;
+}
 
+static void merge_segments (RAM_Memory *memory,
+		RAM_AVL_Node *left, RAM_AVL_Node *right)
+{
+   unsigned int gap;
+
+   if (!((left -> wide) | (right -> wide)))
+      gap = (right -> first) - (left -> last) - 1;
+   else
    {
-      unsigned int i;
-      
-      for (i = 0; i < (memory -> block_size); i ++)
-	 mpz_init ((left -> segment) [i + left_size]);
+      mpz_t g;
+
+      mpz_init (g);
+      mpz_sub (g, (right -> begin), (left -> end));
+      gap = mpz_get_ui (g) - 1;
+      mpz_clear (g);
    }
 
+   join_segments (left, right, gap);
+   avl_delete (&(memory -> root), right);
+   index_invalidate (memory);
+
    (memory -> segment_count) --;
-   (memory -> allocated) += (memory -> block_size);
+   (memory -> allocated) += gap;
+}
+
+
+static inline unsigned int avl_tree_height (RAM_AVL_Node *node)
+{
+   unsigned int height = 0;
+
+   while (node)
+   {
+      if ((node -> balance) >= 0)
+	 node = (node -> right);
+      else
+	 node = (node -> left);
+
+      height ++;
+   }
+
+   return height;
+}
+
+static RAM_AVL_Node *avl_first (RAM_AVL_Node *node)
+{
+   if (node)
+      while (node -> left)
+	 node = (node -> left);
+
+   return node;
+}
+
+static RAM_AVL_Node *avl_next (RAM_AVL_Node *node)
+{
+   if (node -> right)
+      return avl_first (node -> right);
+
+   while ((node -> up) && (node -> up -> right) == node)
+      node = (node -> up);
+
+   return (node -> up);
+}
+
+static RAM_AVL_Node *avl_build (RAM_AVL_Node **nodes, unsigned int n,
+				RAM_AVL_Node *up, unsigned int *height)
+{
+   RAM_AVL_Node *node;
+   unsigned int mid, left_height, right_height;
+
+   if (!n)
+   {
+      (*height) = 0;
+      return NULL;
+   }
+
+   mid = n / 2;
+   node = nodes [mid];
+
+   (node -> up) = up;
+   (node -> left) = avl_build (nodes, mid, node, &left_height);
+   (node -> right) = avl_build (nodes + mid + 1, n - mid - 1, node,
+				   &right_height);
+   (node -> balance) = (int) right_height - (int) left_height;
+
+   (*height) = ((left_height > right_height) ?
+		   left_height : right_height) + 1;
+
+   return node;
+}
+
+/* Joins neighbouring segments separated by at most max_gap registers
+   (gaps are filled with zero registers) and rebuilds the tree perfectly
+   balanced. */
+void ram_memory_compact (RAM_Memory *memory, unsigned int max_gap,
+				RAM_CompactionStats *stats)
+{
+   RAM_AVL_Node **nodes, *node;
+   unsigned int i, count = 0, n = 0, height, added = 0, freed = 0;
+   mpz_t gap;
+
+   if (stats)
+   {
+      (stats -> segments_before) = (memory -> segment_count);
+      (stats -> height_before) = avl_tree_height (memory -> root);
+   }
+
+   nodes = (RAM_AVL_Node **) malloc ((memory -> segment_count) *
+				   sizeof (RAM_AVL_Node *));
+   if (!nodes)
+      err_fatal_perror ("malloc",
+		"could not allocate index for %d segments",
+		(memory -> segment_count));
+
+   for (node = avl_first (memory -> root); node; node = avl_next (node))
+      nodes [count ++] = node;
+
+   mpz_init (gap);
+
+   for (i = 0; i < count; i ++)
+   {
+      node = nodes [i];
+
+      if (n && node != (memory -> begin))
+      {
+	 RAM_AVL_Node *left = nodes [n - 1];
+
+	 mpz_sub (gap, (node -> begin), (left -> end));
+	 mpz_sub_ui (gap, gap, 1);
+	 if (mpz_cmp_ui (gap, max_gap) <= 0)
+	 {
+	    unsigned int g = mpz_get_ui (gap);
+
+	    join_segments (left, node, g);
+	    avl_node_delete (node);
+
+	    added += g;
+	    freed ++;
+	    continue;
+	 }
+      }
+
+      nodes [n ++] = node;
+   }
+
+   mpz_clear (gap);
+
+   (memory -> root) = avl_build (nodes, n, NULL, &height);
+   (memory -> cache) = (memory -> begin);
+   index_invalidate (memory);
+   (memory -> segment_count) = n;
+   (memory -> generation) ++;
+   (memory -> allocated) += added;
+
+   free (nodes);
+
+   if (stats)
+   {
+      (stats -> segments_after) = n;
+      (stats -> height_after) = height;
+      (stats -> registers_added) = added;
+      (stats -> bytes_reclaimed) =
+	      (long) freed * (long) sizeof (RAM_AVL_Node) -
+	      (long) added * REGISTER_BYTES;
+   }
+}
+
+void ram_memory_set_compaction (RAM_Memory *memory, unsigned int segments,
+				unsigned int max_gap)
+{
+   (memory -> compact_threshold) = segments;
+   (memory -> compact_at) = segments;
+   (memory -> compact_gap) = max_gap;
 }
 
 
 void ram_memory_reset (RAM_Memory *rm)
 {
+   (rm -> generation) ++;
+
    if (rm -> allocated)
    {
       shrink_segment ((rm -> begin), (rm -> block_size));
       remove_all_but_begin (rm);
+      index_invalidate (rm);
       (rm -> allocated) = (rm -> block_size);
       (rm -> segment_count) = 1;
-      {
-	 unsigned int i;
-	 for (i = 0; i < (rm -> block_size); i ++)
-	    mpz_set_ui ((rm -> begin -> segment) [i], 0);
-      }
+      (rm -> compact_at) = (rm -> compact_threshold);
+      (rm -> resets) ++;
+      clear_registers ((rm -> begin), 1, (rm -> begin -> size));
+
+      mpz_clear ((rm -> begin -> segment) [0]);
+      mpz_init ((rm -> begin -> segment) [0]);
+      ram_arena_release (rm -> arena);
    }
 }
 
 inline mpz_t *ram_try_to_get_register (RAM_Memory *memory, mpz_t *addr)
 {
-   RAM_AVL_Node *node = find_segment (memory, addr);
+   RAM_AVL_Node *node;
+   Key key;
+
+   make_key (&key, addr);
+   node = find_segment (memory, &key);
    
    if (node)
-      return find_register (node, addr);
+      return find_register (node, &key);
 
    return NULL;
 }
 
-inline mpz_t *ram_get_register_0 (RAM_Memory *memory)
+/* A lookup for observers such as watchpoints: it walks the tree without
+   moving the cache or building the index, and never initializes a
+   register, so a register that was not written yet gives NULL. */
+mpz_t *ram_peek_register (RAM_Memory *memory, mpz_t *addr)
+{
+   RAM_AVL_Node *node = (memory -> root);
+   unsigned long i;
+   Key key;
+
+   make_key (&key, addr);
+
+   while (node)
+      if (key_before (node, &key))
+	 node = (node -> left);
+      else if (key_after (node, &key))
+	 node = (node -> right);
+      else
+	 break;
+
+   if (!node)
+      return NULL;
+
+   if (!((node -> wide) | (key.wide)))
+      i = (key.value) - (node -> first);
+   else
+   {
+      mpz_t offset;
+
+      mpz_init (offset);
+      mpz_sub (offset, *addr, (node -> begin));
+      i = mpz_get_ui (offset);
+      mpz_clear (offset);
+   }
+
+   return (node -> written) [i] ? (node -> segment) + i : NULL;
+}
+
+mpz_t *ram_get_register_0 (RAM_Memory *memory)
 {
    return (memory -> begin -> segment);
 }
 
 
-mpz_t *ram_get_register (RAM_Memory *memory, mpz_t *addr)
+static mpz_t *get_register (RAM_Memory *memory, mpz_t *addr)
 {
    int position;
-   RAM_AVL_Node *node = try_to_find_segment (memory, addr, &position);
+   RAM_AVL_Node *node;
+   Key key;
+
+   make_key (&key, addr);
+   node = try_to_find_segment (memory, &key, &position);
 
    if (position)
    {
-      RAM_AVL_Node	*prev = try_to_find_prev_segment (node, addr,
+      RAM_AVL_Node	*prev = try_to_find_prev_segment (node, &key,
 			 				(memory -> block_size)),
-      			*next = try_to_find_next_segment (node, addr,
+      			*next = try_to_find_next_segment (node, &key,
 							(memory -> block_size));
       mpz_t address, *ret;
+      unsigned int grow = (memory -> block_size);
+      int below_begin = 0;
 
       mpz_init_set (address, *addr);
+      (key.address) = &address;
+
+      /* Register 0 stays first in its segment, so negative addresses
+	 never extend or merge into it; a segment below it stops at -1. */
+      if (next == (memory -> begin))
+      {
+	 next = NULL;
+	 below_begin = 1;
+
+	 if (prev && mpz_cmp_si ((prev -> end), - (long) grow) >= 0)
+	    grow = (unsigned int) (- 1 - mpz_get_si (prev -> end));
+      }
 
       if (prev && next)
       {
          merge_segments (memory, prev, next);
+	 (memory -> generation) ++;
 
 	 (memory -> cache) = prev;
 
-         ret = find_register (prev, &address);
+         ret = find_register (prev, &key);
       }
       else if (prev)
       {
-	 expand_segment (prev, (prev -> size) + (memory -> block_size));
-	 (memory -> allocated) += (memory -> block_size);
+	 expand_segment (prev, (prev -> size) + grow);
+	 (memory -> allocated) += grow;
+	 (memory -> generation) ++;
 
 	 (memory -> cache) = prev;
 
-         ret = find_register (prev, &address);
+         ret = find_register (prev, &key);
       }
       else if (next)
       {
 	 expand_segment_backwards
 		 (next, (next -> size) + (memory -> block_size));
 	 (memory -> allocated) += (memory -> block_size);
+	 (memory -> generation) ++;
 
 	 (memory -> cache) = next;
 
-	 ret = find_register (next, &address);
+	 ret = find_register (next, &key);
       }
       else
       {
          RAM_AVL_Node *new;
+         unsigned int size = block_size;
          mpz_t base;
 
-         mpz_init_set (base, *addr);
-         align_block_start (memory, &base);
+	 align_size (memory, &size);
+         if (below_begin)
+	    mpz_init_set_si (base, - (long) size);
+	 else
+	 {
+	    mpz_init_set (base, *addr);
+	    align_block_start (memory, &base);
+	 }
       
-         new = avl_node_new_for_segment (memory, base, block_size);
+         new = avl_node_new_for_segment (memory, base, size);
          avl_insert (&(memory -> root), node, new, position);
          (memory -> allocated) += (memory -> block_size);
          (memory -> segment_count) ++;
+	 if (memory -> index)
+	    (memory -> index -> inserted) ++;
 
          mpz_clear (base);
 
          (memory -> cache) = new;
 	 
-         ret = find_register (new, &address);
+         ret = find_register (new, &key);
+
+	 if ((memory -> compact_at) &&
+		 (memory -> segment_count) >= (memory -> compact_at))
+	 {
+	    ram_memory_compact (memory, (memory -> compact_gap), NULL);
+	    (memory -> compact_at) = 2 * (memory -> segment_count);
+	    if ((memory -> compact_at) < (memory -> compact_threshold))
+	       (memory -> compact_at) = (memory -> compact_threshold);
+
+	    ret = find_register (find_segment (memory, &key), &key);
+	 }
       }
     
       mpz_clear (address);
@@ -790,7 +1316,53 @@ mpz_t *ram_get_register (RAM_Memory *memory, mpz_t *addr)
       return ret;
    }
    
-   return find_register (node, addr);
+   return find_register (node, &key);
+}
+
+/* The access hook gets the address as read before the lookup, since
+   addr may point into a segment the lookup moves, and whether the cache
+   node answered: it did when the cache is unchanged and nothing moved.
+   Negative addresses and those beyond an unsigned long are not narrow. */
+mpz_t *ram_get_register (RAM_Memory *memory, mpz_t *addr)
+{
+   RAM_MemoryHooks *hooks = (memory -> hooks);
+   RAM_AVL_Node *cache;
+   unsigned long generation, address = 0;
+   int narrow = 0;
+   mpz_t *ret;
+
+   if (!hooks)
+      return get_register (memory, addr);
+
+   cache = (memory -> cache);
+   generation = (memory -> generation);
+   if (hooks -> access && (narrow = mpz_fits_ulong_p (*addr)))
+      address = mpz_get_ui (*addr);
+
+   if (hooks -> enter)
+      (hooks -> enter) (hooks -> data);
+   ret = get_register (memory, addr);
+   if (hooks -> leave)
+      (hooks -> leave) (hooks -> data);
+
+   if (hooks -> access)
+      (hooks -> access) ((hooks -> data), memory, address, narrow,
+		      cache && cache == (memory -> cache) &&
+		      generation == (memory -> generation));
+
+   return ret;
+}
+
+/* For a lookup whose register is about to be set: the segment holding
+   it, which the lookup left in the cache, goes into the next incremental
+   checkpoint. */
+mpz_t *ram_get_register_for_write (RAM_Memory *memory, mpz_t *addr)
+{
+   mpz_t *ret = ram_get_register (memory, addr);
+
+   (memory -> cache -> dirty) = 1;
+
+   return ret;
 }
 
 inline mpz_t *ram_get_register_by_pointer (RAM_Memory *memory, mpz_t *addr)
@@ -817,24 +1389,28 @@ inline mpz_t *ram_get_register_by_indirect_pointer
    return ram_get_register (memory, p);
 }
 
-static inline unsigned int avl_tree_height (RAM_AVL_Node *node)
+unsigned int ram_memory_tree_height (RAM_Memory *memory)
 {
-   unsigned int height = 0;
+   return avl_tree_height (memory -> root);
+}
 
-   while (node)
-   {
-      if ((node -> balance) >= 0)
-	 node = (node -> right);
-      else
-	 node = (node -> left);
+unsigned int ram_memory_written_count (RAM_Memory *memory)
+{
+   RAM_AVL_Node *node;
+   unsigned int count = 0;
 
-      height ++;
-   }
+   for (node = avl_first (memory -> root); node; node = avl_next (node))
+      count += ram_kernel_count_set ((node -> written), (node -> size));
 
-   return height;
+   return count;
 }
 
-unsigned int ram_memory_tree_height (RAM_Memory *memory)
+RAM_AVL_Node *ram_memory_first_segment (RAM_Memory *memory)
 {
-   return avl_tree_height (memory -> root);
+   return avl_first (memory -> root);
+}
+
+RAM_AVL_Node *ram_memory_next_segment (RAM_AVL_Node *node)
+{
+   return avl_next (node);
 }
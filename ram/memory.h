@@ -1,44 +1,100 @@
+#ifndef RAM_MEMORY_H
+#define RAM_MEMORY_H
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <gmp.h>
+#include "arena.h"
 
 
 typedef struct _RAM_AVL_Node
 {
    mpz_t begin, end;
+   unsigned long first, last;
+   int wide;
    unsigned int size;	
 
    mpz_t *segment;
+   unsigned char *written;
 
    int balance;	
+   int dirty;
 
    struct _RAM_AVL_Node *left, *right, *up;
 }
 RAM_AVL_Node;
 
+typedef enum
+{
+   RAM_INDEX_AVL, RAM_INDEX_BTREE
+}
+RAM_SegmentIndexType;
+
+typedef struct _RAM_SegmentIndex RAM_SegmentIndex;
+
 typedef struct
+{
+   void (*enter) (void *);
+   void (*leave) (void *);
+   void (*access) (void *, struct _RAM_Memory *, unsigned long address,
+		   int narrow, int hit);
+   void *data;
+}
+RAM_MemoryHooks;
+
+typedef struct _RAM_Memory
 {
    unsigned int block_size;	
    RAM_AVL_Node *root, *begin,	*cache;		
    unsigned int allocated,	segment_count;	
+
+   unsigned int compact_threshold, compact_gap, compact_at;
+   unsigned int resets;
+   unsigned long generation;
+
+   RAM_Arena *arena;
+   RAM_MemoryHooks *hooks;
+   RAM_SegmentIndex *index;
 }
 RAM_Memory;
 
+typedef struct
+{
+   unsigned int segments_before, segments_after;
+   unsigned int height_before, height_after;
+   unsigned int registers_added;
+   long bytes_reclaimed;
+}
+RAM_CompactionStats;
+
 RAM_Memory *ram_memory_new ();
 void ram_memory_delete (RAM_Memory *);
 
 void ram_memory_reset (RAM_Memory *);
 
 inline mpz_t *ram_try_to_get_register (RAM_Memory *memory, mpz_t *addr);
+mpz_t *ram_peek_register (RAM_Memory *memory, mpz_t *addr);
 
-inline mpz_t *ram_get_register_0 (RAM_Memory *memory);
+mpz_t *ram_get_register_0 (RAM_Memory *memory);
 
 mpz_t *ram_get_register (RAM_Memory *memory, mpz_t *addr);
+mpz_t *ram_get_register_for_write (RAM_Memory *memory, mpz_t *addr);
 inline mpz_t *ram_get_register_by_pointer (RAM_Memory *memory, mpz_t *addr);
 inline mpz_t *ram_get_register_by_indirect_pointer (RAM_Memory *memory,
 						mpz_t *addr);
 void ram_set_block_size (unsigned int);	
+void ram_set_segment_index (RAM_SegmentIndexType);
+void ram_memory_set_segment_index (RAM_Memory *, RAM_SegmentIndexType);
 				
 unsigned int ram_memory_tree_height (RAM_Memory *);
+unsigned int ram_memory_written_count (RAM_Memory *);
+
+RAM_AVL_Node *ram_memory_first_segment (RAM_Memory *);
+RAM_AVL_Node *ram_memory_next_segment (RAM_AVL_Node *);
 
+void ram_memory_compact (RAM_Memory *, unsigned int max_gap,
+				RAM_CompactionStats *);
+void ram_memory_set_compaction (RAM_Memory *, unsigned int segments,
+				unsigned int max_gap);
 
+#endif
@@ -0,0 +1,466 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <gmp.h>
+#include "optimizer.h"
+
+/* Passes over a parsed program, repeated until nothing changes:
+
+   - jumps to an unconditional jump are pointed at its final target,
+     and a jump to the next instruction is dropped;
+   - inside a basic block the accumulator and registers stored with
+     [n] are tracked while their values are known, so constant
+     arithmetic, loads of known registers and jgtz on a known
+     accumulator are folded;
+   - instructions not reachable from the first one are removed.
+
+   The first two change how many instructions a run executes, so with
+   preserve_cost only unreachable code is removed.  Jump targets,
+   source lines and labels are renumbered afterwards.  Optimize before
+   creating machines for the program. */
+
+#define KNOWN_REGISTERS 8
+
+typedef struct
+{
+   mpz_t address, value;
+   int used;
+}
+KnownRegister;
+
+typedef struct
+{
+   RAM_Program *program;
+   unsigned char *leader, *reachable, *removed;
+   RAM_OptimizerStats *stats;
+}
+Optimizer;
+
+static inline int is_jump (RAM_Instruction *ri)
+{
+   return (ri -> instruction) == RAM_JUMP || (ri -> instruction) == RAM_JGTZ;
+}
+
+static inline unsigned int target_of (RAM_Instruction *ri)
+{
+   return mpz_get_ui (ri -> parameter) - 1;
+}
+
+static void set_constant (RAM_Instruction *ri, RAM_InstructionType type,
+				mpz_t value)
+{
+   if ((ri -> parameter_type) == RAM_NO_PARAMETER)
+      mpz_init (ri -> parameter);
+
+   mpz_set ((ri -> parameter), value);
+   (ri -> instruction) = type;
+   (ri -> parameter_type) = RAM_CONSTANT;
+}
+
+static void set_jump (RAM_Instruction *ri, unsigned int target)
+{
+   if ((ri -> parameter_type) == RAM_NO_PARAMETER)
+      mpz_init (ri -> parameter);
+
+   mpz_set_ui ((ri -> parameter), target + 1);
+   (ri -> instruction) = RAM_JUMP;
+   (ri -> parameter_type) = RAM_INSTRUCTION;
+}
+
+static unsigned int next_live (Optimizer *o, unsigned int i)
+{
+   while (i < (o -> program -> n) && (o -> removed) [i])
+      i ++;
+
+   return i;
+}
+
+static void analyse (Optimizer *o)
+{
+   RAM_Program *program = (o -> program);
+   unsigned int n = (program -> n), i, *stack, top = 0;
+
+   memset ((o -> leader), 0, n + 1);
+   memset ((o -> reachable), 0, n + 1);
+
+   stack = (unsigned int *) malloc ((n + 1) * sizeof (unsigned int));
+   if (!stack)
+      err_fatal_perror ("malloc", "could not allocate optimizer stack");
+
+   (o -> leader) [0] = 1;
+   for (i = 0; i < n; i ++)
+   {
+      RAM_Instruction *ri = (program -> instructions) [i];
+
+      if ((o -> removed) [i])
+	 continue;
+
+      if (is_jump (ri) && target_of (ri) < n)
+	 (o -> leader) [next_live (o, target_of (ri))] = 1;
+      if (is_jump (ri) || (ri -> instruction) == RAM_HALT)
+	 (o -> leader) [next_live (o, i + 1)] = 1;
+   }
+
+   if (n)
+      stack [top ++] = 0;
+   while (top)
+   {
+      RAM_Instruction *ri;
+
+      i = stack [-- top];
+      while (i < n && (o -> removed) [i])
+	 i ++;
+      if (i >= n || (o -> reachable) [i])
+	 continue;
+
+      (o -> reachable) [i] = 1;
+      ri = (program -> instructions) [i];
+
+      if (is_jump (ri))
+	 stack [top ++] = target_of (ri);
+      if ((ri -> instruction) != RAM_JUMP && (ri -> instruction) != RAM_HALT)
+	 stack [top ++] = i + 1;
+   }
+
+   free (stack);
+}
+
+static int thread_jumps (Optimizer *o)
+{
+   RAM_Program *program = (o -> program);
+   unsigned int n = (program -> n), i;
+   int changed = 0;
+
+   for (i = 0; i < n; i ++)
+   {
+      RAM_Instruction *ri = (program -> instructions) [i];
+      unsigned int target, hops = 0;
+
+      if ((o -> removed) [i] || !(o -> reachable) [i] || !is_jump (ri))
+	 continue;
+
+      target = next_live (o, target_of (ri));
+      while (target < n && hops ++ < n &&
+	     (program -> instructions) [target] -> instruction == RAM_JUMP &&
+	     target != i)
+	 target = next_live (o,
+		 target_of ((program -> instructions) [target]));
+
+      if (target != target_of (ri))
+      {
+	 mpz_set_ui ((ri -> parameter), target + 1);
+	 (o -> stats -> jumps_threaded) ++;
+	 changed = 1;
+      }
+
+      if ((ri -> instruction) == RAM_JUMP && target == next_live (o, i + 1))
+      {
+	 (o -> removed) [i] = 1;
+	 (o -> stats -> jumps_threaded) ++;
+	 changed = 1;
+      }
+   }
+
+   return changed;
+}
+
+static KnownRegister *find_known (KnownRegister *known, mpz_t address)
+{
+   unsigned int i;
+
+   if (!mpz_sgn (address))
+      return NULL;
+
+   for (i = 0; i < KNOWN_REGISTERS; i ++)
+      if (known [i].used && !mpz_cmp (known [i].address, address))
+	 return known + i;
+
+   return NULL;
+}
+
+static void forget_known (KnownRegister *known)
+{
+   unsigned int i;
+
+   for (i = 0; i < KNOWN_REGISTERS; i ++)
+      known [i].used = 0;
+}
+
+static void remember (KnownRegister *known, mpz_t address, mpz_t value)
+{
+   KnownRegister *k = find_known (known, address);
+   unsigned int i;
+
+   if (!mpz_sgn (address))
+      return;
+
+   for (i = 0; !k && i < KNOWN_REGISTERS; i ++)
+      if (!known [i].used)
+	 k = known + i;
+   if (!k)
+      k = known;
+
+   mpz_set ((k -> address), address);
+   mpz_set ((k -> value), value);
+   (k -> used) = 1;
+}
+
+static int fold_constants (Optimizer *o)
+{
+   RAM_Program *program = (o -> program);
+   unsigned int n = (program -> n), i;
+   KnownRegister known [KNOWN_REGISTERS];
+   mpz_t acc;
+   int acc_known = 0, changed = 0;
+   RAM_Instruction *last_load = NULL;
+
+   mpz_init (acc);
+   for (i = 0; i < KNOWN_REGISTERS; i ++)
+   {
+      mpz_init (known [i].address);
+      mpz_init (known [i].value);
+      known [i].used = 0;
+   }
+
+   for (i = 0; i < n; i ++)
+   {
+      RAM_Instruction *ri = (program -> instructions) [i];
+      KnownRegister *k = NULL;
+      int fold = 0;
+
+      if ((o -> removed) [i] || !(o -> reachable) [i])
+	 continue;
+
+      if ((o -> leader) [i])
+      {
+	 acc_known = 0;
+	 last_load = NULL;
+	 forget_known (known);
+      }
+
+      if ((ri -> parameter_type) == RAM_POINTER)
+	 k = find_known (known, (ri -> parameter));
+
+      switch (ri -> instruction)
+      {
+      case RAM_LOAD:
+	 if ((ri -> parameter_type) == RAM_CONSTANT)
+	    mpz_set (acc, (ri -> parameter));
+	 else if (k)
+	 {
+	    mpz_set (acc, (k -> value));
+	    set_constant (ri, RAM_LOAD, acc);
+	    (o -> stats -> folded) ++;
+	    changed = 1;
+	 }
+	 else
+	 {
+	    acc_known = 0;
+	    break;
+	 }
+	 acc_known = 1;
+	 last_load = ri;
+	 break;
+
+      case RAM_ADD:
+	 if ((ri -> parameter_type) == RAM_CONSTANT || k)
+	 {
+	    mpz_t *value = k ? &(k -> value) : &(ri -> parameter);
+
+	    if (acc_known)
+	    {
+	       mpz_add (acc, acc, *value);
+	       fold = 1;
+	    }
+	    else if (k)
+	    {
+	       set_constant (ri, RAM_ADD, *value);
+	       (o -> stats -> folded) ++;
+	       changed = 1;
+	    }
+	 }
+	 else
+	    acc_known = 0;
+	 break;
+
+      case RAM_NEG:
+	 if (acc_known)
+	 {
+	    mpz_neg (acc, acc);
+	    fold = 1;
+	 }
+	 break;
+
+      case RAM_HALF:
+	 if (acc_known)
+	 {
+	    mpz_tdiv_q_2exp (acc, acc, 1);
+	    fold = 1;
+	 }
+	 break;
+
+      case RAM_STORE:
+	 if ((ri -> parameter_type) == RAM_POINTER)
+	 {
+	    if (acc_known)
+	       remember (known, (ri -> parameter), acc);
+	    else if (k)
+	       (k -> used) = 0;
+	 }
+	 else
+	 {
+	    acc_known = 0;
+	    forget_known (known);
+	 }
+	 last_load = NULL;
+	 break;
+
+      case RAM_WRITE:
+	 last_load = NULL;
+	 break;
+
+      case RAM_JGTZ:
+	 if (acc_known)
+	 {
+	    if (mpz_sgn (acc) > 0)
+	       set_jump (ri, target_of (ri));
+	    else
+	       (o -> removed) [i] = 1;
+	    (o -> stats -> folded) ++;
+	    changed = 1;
+	 }
+	 break;
+
+      default:
+	 acc_known = 0;
+	 last_load = NULL;
+	 break;
+      }
+
+      if (fold)
+      {
+	 if (last_load)
+	 {
+	    mpz_set ((last_load -> parameter), acc);
+	    (o -> removed) [i] = 1;
+	 }
+	 else
+	 {
+	    set_constant (ri, RAM_LOAD, acc);
+	    last_load = ri;
+	 }
+
+	 (o -> stats -> folded) ++;
+	 changed = 1;
+      }
+   }
+
+   for (i = 0; i < KNOWN_REGISTERS; i ++)
+   {
+      mpz_clear (known [i].address);
+      mpz_clear (known [i].value);
+   }
+   mpz_clear (acc);
+
+   return changed;
+}
+
+static void compact_program (Optimizer *o)
+{
+   RAM_Program *program = (o -> program);
+   unsigned int n = (program -> n), i, kept = 0, *map;
+
+   map = (unsigned int *) malloc ((n + 1) * sizeof (unsigned int));
+   if (!map)
+      err_fatal_perror ("malloc", "could not allocate instruction map");
+
+   for (i = 0; i < n; i ++)
+   {
+      map [i] = kept;
+      if (!(o -> removed) [i] && (o -> reachable) [i])
+	 kept ++;
+      else if (!(o -> removed) [i])
+	 (o -> stats -> unreachable) ++;
+   }
+   map [n] = kept;
+
+   for (i = 0; i < n; i ++)
+   {
+      RAM_Instruction *ri = (program -> instructions) [i];
+
+      if ((o -> removed) [i] || !(o -> reachable) [i])
+      {
+	 ram_instruction_delete (ri);
+	 continue;
+      }
+
+      if (is_jump (ri))
+	 mpz_set_ui ((ri -> parameter),
+		 map [target_of (ri) < n ? target_of (ri) : n] + 1);
+
+      (program -> instructions) [map [i]] = ri;
+      if (map [i] < (program -> lines_size) && i < (program -> lines_size))
+	 (program -> lines) [map [i]] = (program -> lines) [i];
+   }
+
+   for (i = 0; i < (program -> label_count); i ++)
+   {
+      unsigned int target = (program -> labels) [i].instruction - 1;
+
+      (program -> labels) [i].instruction =
+	      map [target < n ? target : n] + 1;
+   }
+
+   for (i = kept; i < n && i < (program -> lines_size); i ++)
+      (program -> lines) [i] = 0;
+
+   (program -> n) = kept;
+
+   free (map);
+}
+
+void ram_program_optimize (RAM_Program *program, int preserve_cost,
+				RAM_OptimizerStats *stats)
+{
+   RAM_OptimizerStats local;
+   Optimizer o;
+   unsigned int n = (program -> n);
+   int changed;
+
+   ram_program_unshare (program);
+
+   if (!stats)
+      stats = &local;
+   memset (stats, 0, sizeof (RAM_OptimizerStats));
+   (stats -> instructions_before) = n;
+
+   (o.program) = program;
+   (o.stats) = stats;
+   (o.leader) = (unsigned char *) malloc (n + 1);
+   (o.reachable) = (unsigned char *) malloc (n + 1);
+   (o.removed) = (unsigned char *) calloc (n + 1, 1);
+   if (!(o.leader) || !(o.reachable) || !(o.removed))
+      err_fatal_perror ("malloc", "could not allocate optimizer state");
+
+   do
+   {
+      analyse (&o);
+
+      changed = 0;
+      if (!preserve_cost)
+      {
+	 changed |= thread_jumps (&o);
+	 if (changed)
+	    analyse (&o);
+	 changed |= fold_constants (&o);
+      }
+   }
+   while (changed);
+
+   compact_program (&o);
+   (stats -> instructions_after) = (program -> n);
+
+   free (o.leader);
+   free (o.reachable);
+   free (o.removed);
+}
@@ -0,0 +1,19 @@
+#ifndef RAM_OPTIMIZER_H
+#define RAM_OPTIMIZER_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "ram.h"
+
+
+typedef struct
+{
+   unsigned int instructions_before, instructions_after;
+   unsigned int unreachable, folded, jumps_threaded;
+}
+RAM_OptimizerStats;
+
+void ram_program_optimize (RAM_Program *, int preserve_cost,
+				RAM_OptimizerStats *);
+
+#endif
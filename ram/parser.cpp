@@ -2,25 +2,14 @@
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <gmp.h>
 #include "ram.h"
 
-static InstructionName instruction_names[] =
-{
-   {"read", RAM_READ},   //     
-   {"write", RAM_WRITE},  //   
-   {"load", RAM_LOAD},   //   
-   {"store", RAM_STORE},  //     
-   {"add", RAM_ADD},    //   
-   {"neg", RAM_NEG},    //    
-   {"half", RAM_HALF},   //   /2
-   {"jump", RAM_JUMP},  //     
-   {"jgtz", RAM_JGTZ},   //     ,    >0
-   {"halt", RAM_HALT},   //ʳ  
-   {NULL, RAM_NONE}
-};
-
-
 typedef struct _TextLine
 {
    char *line;
@@ -58,13 +47,6 @@ typedef struct
 }
 ParserData;
 
-typedef struct
-{
-   const char *name;
-   RAM_InstructionType instruction;
-}
-InstructionName;
-
 static const char *INPUT_DELIMITERS = " \t\n";
 
 static const int CONSTANT_PARAMETER = 0x01;
@@ -74,16 +56,11 @@ static const int INDIRECT_POINTER_PARAMETER = 0x08;
 }
 static RAM_InstructionType get_instruction (const char *s)
 {
-   InstructionName *in;
-
-   in = instruction_names;
-   while (in -> name)
-   {
-      if (! strcasecmp ((in -> name), s))
-	 return (in -> instruction);
+   int k;
 
-      in ++;
-   }
+   for (k = RAM_READ; k <= RAM_HALT; k ++)
+      if (! strcasecmp (ram_instruction_names [k], s))
+	 return (RAM_InstructionType) k;
 
    return RAM_NONE;
 }
@@ -194,6 +171,8 @@ static int parse_instruction (ParserData *pd, char *token,
       (l -> next) = (pd -> labels);
       (pd -> labels) = l;
 
+      ram_program_add_label ((pd -> program), token, (pd -> instruction));
+
       type = get_instruction (token);
       if (type == RAM_NONE)
       {
@@ -207,6 +186,8 @@ static int parse_instruction (ParserData *pd, char *token,
 
       i = instruction_new ();
       (i -> line) = (pd -> line_no);
+      ram_program_set_line ((pd -> program), (pd -> instruction),
+		      (pd -> line_no));
       (i -> next) = (pd -> instructions);
       (pd -> instructions) = i;
 
@@ -232,6 +213,15 @@ static int parse_instruction (ParserData *pd, char *token,
       case RAM_JGTZ:
 	 parse_result = parse_argument (token, i, INSTRUCTION_PARAMETER);
 	 break;
+      case RAM_READ:
+      case RAM_WRITE:
+	 if (token && *token)
+	 {
+	    mpz_init_set_ui ((i -> instruction -> parameter),
+			    ram_program_add_tape ((pd -> program), token));
+	    (i -> instruction -> parameter_type) = RAM_TAPE;
+	 }
+	 break;
       default:
 	 break;
       }
@@ -248,3 +238,477 @@ static int parse_instruction (ParserData *pd, char *token,
    return 1;
 }
 
+
+/* Parallel parsing of large files.  The file is mapped and cut into
+   chunks at line boundaries, and every chunk is tokenized and decoded
+   by its own thread into a local instruction array.  Labels, tape names
+   and label references are kept aside, since their numbering depends on
+   the chunks before.  The final pass on the calling thread numbers the
+   instructions, registers tapes in source order and resolves the
+   references through a hash of all labels.
+
+   Each thread is given at least PARALLEL_CHUNK bytes, so small files
+   are parsed by one thread. */
+
+static const size_t PARALLEL_CHUNK = 1 << 20;
+
+typedef struct
+{
+   const char *start, *end;
+
+   Instruction *instructions;
+   unsigned int count, allocated;
+   RAM_Label *labels;
+   unsigned int label_count, labels_allocated;
+
+   unsigned int lines, first_line;
+   unsigned int error_line;
+   const char *error;
+}
+Chunk;
+
+static char *next_token (char **line)
+{
+   char *token;
+   size_t length;
+
+   token = (*line) + strspn (*line, INPUT_DELIMITERS);
+   if (!(*token))
+      return NULL;
+
+   length = strcspn (token, INPUT_DELIMITERS);
+   (*line) = token + length;
+   if (**line)
+   {
+      (**line) = '\0';
+      (*line) ++;
+   }
+
+   return token;
+}
+
+static Instruction *chunk_instruction (Chunk *c)
+{
+   if ((c -> count) == (c -> allocated))
+   {
+      (c -> allocated) = (c -> allocated) ? 2 * (c -> allocated) : 1024;
+      (c -> instructions) = (Instruction *) realloc ((c -> instructions),
+		      (c -> allocated) * sizeof (Instruction));
+      if (!(c -> instructions))
+	 err_fatal_perror ("realloc", "could not allocate %d instructions",
+			 (c -> allocated));
+   }
+
+   return (Instruction *) memset ((c -> instructions) + (c -> count) ++, 0,
+		   sizeof (Instruction));
+}
+
+static void chunk_label (Chunk *c, const char *name)
+{
+   RAM_Label *label;
+
+   if ((c -> label_count) == (c -> labels_allocated))
+   {
+      (c -> labels_allocated) =
+	      (c -> labels_allocated) ? 2 * (c -> labels_allocated) : 64;
+      (c -> labels) = (RAM_Label *) realloc ((c -> labels),
+		      (c -> labels_allocated) * sizeof (RAM_Label));
+      if (!(c -> labels))
+	 err_fatal_perror ("realloc", "could not allocate %d labels",
+			 (c -> labels_allocated));
+   }
+
+   label = (c -> labels) + (c -> label_count) ++;
+   (label -> name) = strndup (name, strcspn (name, ":"));
+   (label -> instruction) = (c -> count) + 1;
+}
+
+static int parse_chunk_line (Chunk *c, char *token, char **line)
+{
+   RAM_InstructionType type;
+   Instruction *i;
+   int parse_result = 1;
+
+   type = get_instruction (token);
+   if (type == RAM_NONE)
+   {
+      chunk_label (c, token);
+
+      token = next_token (line);
+      if (token)
+	 type = get_instruction (token);
+
+      if (type == RAM_NONE)
+      {
+	 (c -> error) = "no instruction found";
+	 return 0;
+      }
+   }
+
+   i = chunk_instruction (c);
+   (i -> line) = (c -> lines);
+   (i -> instruction) = ram_instruction_new ();
+   (i -> instruction -> instruction) = type;
+
+   token = next_token (line);
+
+   switch (type)
+   {
+   case RAM_LOAD:
+   case RAM_ADD:
+      parse_result = parse_argument (token, i, CONSTANT_PARAMETER |
+			 POINTER_PARAMETER | INDIRECT_POINTER_PARAMETER);
+      break;
+   case RAM_STORE:
+      parse_result = parse_argument (token, i, POINTER_PARAMETER |
+			 INDIRECT_POINTER_PARAMETER);
+      break;
+   case RAM_JUMP:
+   case RAM_JGTZ:
+      parse_result = parse_argument (token, i, INSTRUCTION_PARAMETER);
+      break;
+   case RAM_READ:
+   case RAM_WRITE:
+      if (token && *token)
+	 (i -> reference) = strdup (token);
+      break;
+   default:
+      break;
+   }
+
+   if (!parse_result)
+   {
+      (c -> error) = "error in argument";
+      return 0;
+   }
+
+   return 1;
+}
+
+static void *parse_chunk (void *data)
+{
+   Chunk *c = (Chunk *) data;
+   const char *p = (c -> start);
+   char *buffer = NULL;
+   size_t size = 0;
+
+   while (p < (c -> end))
+   {
+      const char *eol;
+      char *line, *token;
+      size_t length;
+
+      eol = (const char *) memchr (p, '\n', (c -> end) - p);
+      length = (eol ? eol : (c -> end)) - p;
+
+      if (length + 1 > size)
+      {
+	 size = 2 * length + 64;
+	 buffer = (char *) realloc (buffer, size);
+	 if (!buffer)
+	    err_fatal_perror ("realloc", "could not allocate line buffer");
+      }
+
+      memcpy (buffer, p, length);
+      buffer [length] = '\0';
+      p += length + 1;
+      (c -> lines) ++;
+
+      line = buffer;
+      token = next_token (&line);
+      if (token && !parse_chunk_line (c, token, &line))
+      {
+	 (c -> error_line) = (c -> lines);
+	 break;
+      }
+   }
+
+   free (buffer);
+
+   return NULL;
+}
+
+/* An unresolved jump has its parameter type set but no parameter. */
+static void chunk_clear (Chunk *c, int instructions)
+{
+   unsigned int k;
+
+   for (k = 0; k < (c -> count); k ++)
+   {
+      Instruction *i = (c -> instructions) + k;
+
+      if ((i -> reference) && instructions)
+	 (i -> instruction -> parameter_type) = RAM_NO_PARAMETER;
+      if (instructions)
+	 ram_instruction_delete (i -> instruction);
+
+      free ((char *) (i -> reference));
+   }
+
+   for (k = 0; instructions && k < (c -> label_count); k ++)
+      free ((c -> labels) [k].name);
+
+   free (c -> instructions);
+   free (c -> labels);
+}
+
+static unsigned long label_hash (const char *name)
+{
+   unsigned long h = 0xcbf29ce484222325UL;
+
+   while (*name)
+      h = (h ^ (unsigned char) *name ++) * 0x100000001b3UL;
+
+   return h;
+}
+
+/* Open addressing over the program's labels; the first of several
+   labels with one name wins, as in ram_program_find_label. */
+static unsigned int *label_table (RAM_Program *program, unsigned long *mask)
+{
+   unsigned int *table, k;
+   unsigned long size = 16;
+
+   while (size < 2UL * (program -> label_count))
+      size *= 2;
+
+   table = (unsigned int *) calloc (size, sizeof (unsigned int));
+   if (!table)
+      err_fatal_perror ("calloc", "could not allocate label table");
+
+   for (k = 0; k < (program -> label_count); k ++)
+   {
+      const char *name = (program -> labels) [k].name;
+      unsigned long h = label_hash (name) & (size - 1);
+
+      while (table [h] && strcmp ((program -> labels) [table [h] - 1].name,
+				  name))
+	 h = (h + 1) & (size - 1);
+
+      if (!table [h])
+	 table [h] = k + 1;
+   }
+
+   (*mask) = size - 1;
+
+   return table;
+}
+
+static unsigned int find_label (RAM_Program *program, unsigned int *table,
+				unsigned long mask, const char *name)
+{
+   unsigned long h = label_hash (name) & mask;
+
+   for (; table [h]; h = (h + 1) & mask)
+      if (!strcmp ((program -> labels) [table [h] - 1].name, name))
+	 return (program -> labels) [table [h] - 1].instruction;
+
+   return 0;
+}
+
+static RAM_Program *merge_chunks (Chunk *chunks, unsigned int n)
+{
+   RAM_Program *program;
+   unsigned int c, k, base = 0, labels = 0, *table;
+   unsigned long mask;
+   unsigned int error_line = 0;
+   const char *error = NULL;
+
+   for (c = 0; c < n; c ++)
+   {
+      base += chunks [c].count;
+      labels += chunks [c].label_count;
+   }
+
+   program = ram_program_new ();
+   (program -> instructions) = (RAM_Instruction **)
+	   malloc (base * sizeof (RAM_Instruction *));
+   (program -> labels) = (RAM_Label *)
+	   malloc (labels * sizeof (RAM_Label));
+   if ((base && !(program -> instructions)) ||
+       (labels && !(program -> labels)))
+      err_fatal_perror ("malloc", "could not allocate %d instructions",
+		      base);
+
+   for (base = 0, c = 0; c < n; c ++)
+   {
+      Chunk *ch = chunks + c;
+
+      for (k = 0; k < (ch -> count); k ++)
+      {
+	 Instruction *i = (ch -> instructions) + k;
+
+	 (program -> instructions) [base + k] = (i -> instruction);
+	 ram_program_set_line (program, base + k + 1,
+			 (ch -> first_line) + (i -> line));
+      }
+
+      for (k = 0; k < (ch -> label_count); k ++)
+      {
+	 (program -> labels) [program -> label_count] = (ch -> labels) [k];
+	 (program -> labels) [program -> label_count ++].instruction += base;
+      }
+
+      base += (ch -> count);
+   }
+
+   (program -> n) = base;
+
+   table = label_table (program, &mask);
+
+   for (c = 0; c < n; c ++)
+   {
+      Chunk *ch = chunks + c;
+
+      for (k = 0; k < (ch -> count); k ++)
+      {
+	 Instruction *i = (ch -> instructions) + k;
+	 RAM_Instruction *ri = (i -> instruction);
+	 unsigned int target;
+
+	 if (!(i -> reference))
+	    continue;
+
+	 if ((ri -> instruction) == RAM_READ ||
+	     (ri -> instruction) == RAM_WRITE)
+	 {
+	    mpz_init_set_ui ((ri -> parameter),
+			    ram_program_add_tape (program, (i -> reference)));
+	    (ri -> parameter_type) = RAM_TAPE;
+	    continue;
+	 }
+
+	 target = find_label (program, table, mask, (i -> reference));
+	 if (!target)
+	 {
+	    (ri -> parameter_type) = RAM_NO_PARAMETER;
+	    if (!error)
+	    {
+	       error = "undefined label";
+	       error_line = (ch -> first_line) + (i -> line);
+	    }
+	    continue;
+	 }
+
+	 mpz_init_set_ui ((ri -> parameter), target);
+      }
+
+      chunk_clear (ch, 0);
+   }
+
+   free (table);
+
+   if (error)
+   {
+      parse_error (error_line, error);
+      ram_program_delete (program);
+      return NULL;
+   }
+
+   return program;
+}
+
+RAM_Program *ram_program_parse_parallel (const char *path,
+				unsigned int threads)
+{
+   RAM_Program *program = NULL;
+   Chunk *chunks;
+   pthread_t *ids;
+   struct stat st;
+   const char *map = NULL, *p;
+   unsigned int n, c;
+   int fd;
+
+   fd = open (path, O_RDONLY);
+   if (fd < 0)
+      return NULL;
+
+   if (fstat (fd, &st))
+      err_fatal_perror ("fstat", "could not read %s", path);
+
+   if (st.st_size)
+   {
+      map = (const char *) mmap (NULL, st.st_size, PROT_READ, MAP_PRIVATE,
+		      fd, 0);
+      if (map == MAP_FAILED)
+	 err_fatal_perror ("mmap", "could not map %s", path);
+   }
+
+   close (fd);
+
+   if (!threads)
+      threads = sysconf (_SC_NPROCESSORS_ONLN);
+
+   n = st.st_size / PARALLEL_CHUNK;
+   if (n > threads)
+      n = threads;
+   if (!n)
+      n = 1;
+
+   chunks = (Chunk *) calloc (n, sizeof (Chunk));
+   ids = (pthread_t *) malloc (n * sizeof (pthread_t));
+   if (!chunks || !ids)
+      err_fatal_perror ("malloc", "could not allocate %u parser chunks", n);
+
+   for (p = map, c = 0; c < n; c ++)
+   {
+      const char *end = map + st.st_size * (c + 1) / n;
+
+      if (end < p)
+	 end = p;
+
+      if (c + 1 == n)
+	 end = map + st.st_size;
+      else if (end > p)
+      {
+	 end = (const char *) memchr (end - 1, '\n', map + st.st_size -
+			 (end - 1));
+	 end = end ? end + 1 : map + st.st_size;
+      }
+
+      (chunks [c].start) = p;
+      (chunks [c].end) = end;
+      p = end;
+   }
+
+   for (c = 1; c < n; c ++)
+      if (pthread_create (ids + c, NULL, parse_chunk, chunks + c))
+	 err_fatal_perror ("pthread_create",
+			 "could not start parser thread %u", c);
+
+   parse_chunk (chunks);
+
+   for (c = 1; c < n; c ++)
+      pthread_join (ids [c], NULL);
+
+   for (c = 0; c < n; c ++)
+   {
+      if (c)
+	 (chunks [c].first_line) =
+		 (chunks [c - 1].first_line) + (chunks [c - 1].lines);
+
+      if ((chunks [c].error) && !(chunks [0].error))
+      {
+	 (chunks [0].error) = (chunks [c].error);
+	 (chunks [0].error_line) =
+		 (chunks [c].first_line) + (chunks [c].error_line);
+      }
+   }
+
+   if (chunks [0].error)
+   {
+      parse_error ((chunks [0].error_line), (chunks [0].error));
+      for (c = 0; c < n; c ++)
+	 chunk_clear (chunks + c, 1);
+   }
+   else
+      program = merge_chunks (chunks, n);
+
+   if (map)
+      munmap ((void *) map, st.st_size);
+
+   free (ids);
+   free (chunks);
+
+   return program;
+}
@@ -0,0 +1,243 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <gmp.h>
+#include "perf.h"
+
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
+
+/* Hardware counters read around batches of steps (the run region)
+   and around ram_get_register (the memory region).  Reading a counter
+   group costs a system call, so only one register lookup in
+   sample_every is measured and the memory totals are scaled up by the
+   number of lookups.  The memory region is part of the run region.
+   When perf events are unavailable every counter reads zero. */
+
+static const unsigned long RUN_STEPS = 1UL << 16;
+
+static const char *event_names [] =
+{
+   "cycles", "instructions", "cache-misses", "branch-misses"
+};
+
+static const char *region_names [] = { "run", "memory" };
+
+#ifdef __linux__
+static const unsigned long long event_configs [] =
+{
+   PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS,
+   PERF_COUNT_HW_CACHE_MISSES, PERF_COUNT_HW_BRANCH_MISSES
+};
+
+static int open_event (RAM_PerfEvent event, int group)
+{
+   struct perf_event_attr attr;
+
+   memset (&attr, 0, sizeof (attr));
+   attr.size = sizeof (attr);
+   attr.type = PERF_TYPE_HARDWARE;
+   attr.config = event_configs [event];
+   attr.disabled = (group == -1);
+   attr.exclude_kernel = 1;
+   attr.exclude_hv = 1;
+   attr.read_format = PERF_FORMAT_GROUP;
+
+   return syscall (__NR_perf_event_open, &attr, 0, -1, group, 0);
+}
+#endif
+
+static void read_counters (RAM_Perf *perf, unsigned long long *values)
+{
+   unsigned long long buffer [RAM_PERF_EVENTS + 1];
+   unsigned int i;
+
+   memset (values, 0, RAM_PERF_EVENTS * sizeof (unsigned long long));
+
+   if ((perf -> leader) < 0 ||
+       read ((perf -> leader), buffer, sizeof (buffer)) <
+	       (ssize_t) (((perf -> opened) + 1) * sizeof (unsigned long long)))
+      return;
+
+   for (i = 0; i < RAM_PERF_EVENTS; i ++)
+      if ((perf -> slot) [i] >= 0)
+	 values [i] = buffer [(perf -> slot) [i] + 1];
+}
+
+static void add_delta (RAM_Perf *perf, RAM_PerfRegion region,
+				unsigned long long *from)
+{
+   unsigned long long now [RAM_PERF_EVENTS];
+   unsigned int i;
+
+   read_counters (perf, now);
+   for (i = 0; i < RAM_PERF_EVENTS; i ++)
+      (perf -> total) [region][i] += now [i] - from [i];
+}
+
+static void memory_enter (void *data)
+{
+   RAM_Perf *perf = (RAM_Perf *) data;
+
+   if ((perf -> depth) ++)
+      return;
+
+   if ((perf -> calls) ++ % (perf -> sample_every))
+      return;
+
+   (perf -> measuring) = 1;
+   read_counters (perf, (perf -> start));
+}
+
+static void memory_leave (void *data)
+{
+   RAM_Perf *perf = (RAM_Perf *) data;
+
+   if (-- (perf -> depth) || !(perf -> measuring))
+      return;
+
+   add_delta (perf, RAM_PERF_MEMORY, (perf -> start));
+   (perf -> measuring) = 0;
+   (perf -> sampled) ++;
+}
+
+RAM_Perf *ram_perf_new (unsigned long sample_every)
+{
+   RAM_Perf *perf;
+   unsigned int i;
+
+   perf = (RAM_Perf *) calloc (1, sizeof (RAM_Perf));
+   if (!perf)
+      err_fatal_perror ("calloc", "could not allocate RAM_Perf structure");
+
+   (perf -> sample_every) = sample_every ? sample_every : 1;
+   (perf -> leader) = -1;
+   for (i = 0; i < RAM_PERF_EVENTS; i ++)
+   {
+      (perf -> fd) [i] = -1;
+      (perf -> slot) [i] = -1;
+   }
+
+#ifdef __linux__
+   for (i = 0; i < RAM_PERF_EVENTS; i ++)
+   {
+      int fd = open_event ((RAM_PerfEvent) i, (perf -> leader));
+
+      if (fd < 0)
+	 continue;
+
+      if ((perf -> leader) < 0)
+	 (perf -> leader) = fd;
+      (perf -> fd) [i] = fd;
+      (perf -> slot) [i] = (perf -> opened) ++;
+   }
+
+   if ((perf -> leader) >= 0)
+   {
+      ioctl ((perf -> leader), PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+      ioctl ((perf -> leader), PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+   }
+#endif
+
+   (perf -> hooks).enter = memory_enter;
+   (perf -> hooks).leave = memory_leave;
+   (perf -> hooks).data = perf;
+
+   return perf;
+}
+
+void ram_perf_delete (RAM_Perf *perf)
+{
+   unsigned int i;
+
+   for (i = 0; i < RAM_PERF_EVENTS; i ++)
+      if ((perf -> fd) [i] >= 0)
+	 close ((perf -> fd) [i]);
+
+   free (perf);
+}
+
+int ram_perf_available (RAM_Perf *perf)
+{
+   return (perf -> leader) >= 0;
+}
+
+/* A memory has one set of hooks, so attaching fails while the heatmap
+   or another RAM_Perf is attached. */
+int ram_perf_attach (RAM_Perf *perf, RAM *machine)
+{
+   if ((machine -> memory -> hooks) &&
+       (machine -> memory -> hooks) != &(perf -> hooks))
+      return 0;
+
+   (machine -> memory -> hooks) = &(perf -> hooks);
+
+   return 1;
+}
+
+void ram_perf_detach (RAM_Perf *perf, RAM *machine)
+{
+   if ((machine -> memory -> hooks) == &(perf -> hooks))
+      (machine -> memory -> hooks) = NULL;
+}
+
+unsigned long ram_perf_run (RAM_Perf *perf, RAM *machine,
+				unsigned long steps)
+{
+   unsigned long long start [RAM_PERF_EVENTS];
+   unsigned long done = 0, batch;
+
+   read_counters (perf, start);
+
+   do
+   {
+      batch = ram_run (machine, (steps - done) < RUN_STEPS ?
+		      (steps - done) : RUN_STEPS);
+      done += batch;
+   }
+   while (batch && done < steps);
+
+   add_delta (perf, RAM_PERF_RUN, start);
+   (perf -> steps) += done;
+
+   return done;
+}
+
+void ram_perf_report (RAM_Perf *perf, FILE *out)
+{
+   double scale [RAM_PERF_REGIONS];
+   unsigned int r, i;
+
+   if (!ram_perf_available (perf))
+   {
+      fprintf (out, "perf: hardware counters unavailable\n");
+      return;
+   }
+
+   scale [RAM_PERF_RUN] = 1.0;
+   scale [RAM_PERF_MEMORY] = (perf -> sampled) ?
+	   (double) (perf -> calls) / (double) (perf -> sampled) : 0.0;
+
+   fprintf (out, "perf: %lu steps, %lu register lookups (%lu sampled)\n",
+		   (perf -> steps), (perf -> calls), (perf -> sampled));
+
+   for (r = 0; r < RAM_PERF_REGIONS; r ++)
+   {
+      fprintf (out, "%-8s", region_names [r]);
+      for (i = 0; i < RAM_PERF_EVENTS; i ++)
+      {
+	 double per_step = (perf -> steps) ?
+		 (perf -> total) [r][i] * scale [r] / (perf -> steps) : 0.0;
+
+	 if ((perf -> slot) [i] < 0)
+	    fprintf (out, "  %s n/a", event_names [i]);
+	 else
+	    fprintf (out, "  %s %.2f", event_names [i], per_step);
+      }
+      fprintf (out, "  (per step)\n");
+   }
+}
@@ -0,0 +1,52 @@
+#ifndef RAM_PERF_H
+#define RAM_PERF_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "ram.h"
+
+
+typedef enum
+{
+   RAM_PERF_CYCLES = 0,
+   RAM_PERF_INSTRUCTIONS,
+   RAM_PERF_CACHE_MISSES,
+   RAM_PERF_BRANCH_MISSES,
+   RAM_PERF_EVENTS
+}
+RAM_PerfEvent;
+
+typedef enum
+{
+   RAM_PERF_RUN = 0,
+   RAM_PERF_MEMORY,
+   RAM_PERF_REGIONS
+}
+RAM_PerfRegion;
+
+typedef struct
+{
+   int leader, fd [RAM_PERF_EVENTS], slot [RAM_PERF_EVENTS];
+   unsigned int opened;
+
+   unsigned long long total [RAM_PERF_REGIONS][RAM_PERF_EVENTS];
+   unsigned long long start [RAM_PERF_EVENTS];
+
+   unsigned long steps, calls, sampled, sample_every;
+   int depth, measuring;
+
+   RAM_MemoryHooks hooks;
+}
+RAM_Perf;
+
+RAM_Perf *ram_perf_new (unsigned long sample_every);
+void ram_perf_delete (RAM_Perf *);
+int ram_perf_available (RAM_Perf *);
+
+int ram_perf_attach (RAM_Perf *, RAM *);
+void ram_perf_detach (RAM_Perf *, RAM *);
+
+unsigned long ram_perf_run (RAM_Perf *, RAM *, unsigned long steps);
+void ram_perf_report (RAM_Perf *, FILE *);
+
+#endif
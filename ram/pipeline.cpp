@@ -0,0 +1,297 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+#include <pthread.h>
+#include <gmp.h>
+#include "pipeline.h"
+
+/* Machines in a pipeline run on their own threads, the output of each
+   feeding the input of the next through a single producer, single
+   consumer ring.  The producer only moves tail and the consumer only
+   moves head, so neither side takes a lock.  Ring values live outside
+   the machine arenas since both threads touch them.
+
+   READ and WRITE never block on a ring: they leave the machine waiting
+   on it, and the stage thread (or a scheduler) retries later. */
+
+static const unsigned int SPIN_LIMIT = 64;
+static const unsigned long STAGE_STEPS = 4096, RING_CAPACITY = 1024;
+
+RAM_Ring *ram_ring_new (unsigned long capacity)
+{
+   RAM_Ring *ring;
+   RAM_Arena *arena;
+   unsigned long i;
+
+   ring = (RAM_Ring *) calloc (1, sizeof (RAM_Ring));
+   if (!ring)
+      err_fatal_perror ("calloc", "could not allocate RAM_Ring structure");
+
+   if (!capacity)
+      capacity = RING_CAPACITY;
+
+   (ring -> values) = (mpz_t *) malloc (capacity * sizeof (mpz_t));
+   if (!(ring -> values))
+      err_fatal_perror ("malloc", "could not allocate %lu ring values",
+		      capacity);
+
+   arena = ram_arena_enter (NULL);
+   for (i = 0; i < capacity; i ++)
+      mpz_init ((ring -> values) [i]);
+   ram_arena_leave (arena);
+
+   (ring -> capacity) = capacity;
+
+   return ring;
+}
+
+void ram_ring_delete (RAM_Ring *ring)
+{
+   RAM_Arena *arena;
+   unsigned long i;
+
+   arena = ram_arena_enter (NULL);
+   for (i = 0; i < (ring -> capacity); i ++)
+      mpz_clear ((ring -> values) [i]);
+   ram_arena_leave (arena);
+
+   free (ring -> values);
+   free (ring);
+}
+
+static void backoff (unsigned int *spins)
+{
+   if ((*spins) < SPIN_LIMIT)
+      (*spins) ++;
+   else
+      sched_yield ();
+}
+
+int ram_ring_try_put (RAM_Ring *ring, mpz_t value)
+{
+   unsigned long tail;
+   RAM_Arena *arena;
+
+   if (__atomic_load_n (&(ring -> abandoned), __ATOMIC_ACQUIRE))
+      return -1;
+
+   tail = __atomic_load_n (&(ring -> tail), __ATOMIC_RELAXED);
+   if (tail - __atomic_load_n (&(ring -> head), __ATOMIC_ACQUIRE) >=
+		   (ring -> capacity))
+      return 0;
+
+   arena = ram_arena_enter (NULL);
+   mpz_set ((ring -> values) [tail % (ring -> capacity)], value);
+   ram_arena_leave (arena);
+
+   __atomic_store_n (&(ring -> tail), tail + 1, __ATOMIC_RELEASE);
+
+   return 1;
+}
+
+int ram_ring_try_get (RAM_Ring *ring, mpz_t value)
+{
+   unsigned long head;
+
+   head = __atomic_load_n (&(ring -> head), __ATOMIC_RELAXED);
+   if (head == __atomic_load_n (&(ring -> tail), __ATOMIC_ACQUIRE))
+   {
+      if (__atomic_load_n (&(ring -> closed), __ATOMIC_ACQUIRE) &&
+	  head == __atomic_load_n (&(ring -> tail), __ATOMIC_ACQUIRE))
+	 return -1;
+
+      return 0;
+   }
+
+   mpz_set (value, (ring -> values) [head % (ring -> capacity)]);
+
+   __atomic_store_n (&(ring -> head), head + 1, __ATOMIC_RELEASE);
+
+   return 1;
+}
+
+int ram_ring_put (RAM_Ring *ring, mpz_t value)
+{
+   unsigned int spins = 0;
+   int put;
+
+   while (!(put = ram_ring_try_put (ring, value)))
+      backoff (&spins);
+
+   return put > 0;
+}
+
+int ram_ring_get (RAM_Ring *ring, mpz_t value)
+{
+   unsigned int spins = 0;
+   int got;
+
+   while (!(got = ram_ring_try_get (ring, value)))
+      backoff (&spins);
+
+   return got > 0;
+}
+
+int ram_ring_ready (RAM_Ring *ring, int for_write)
+{
+   unsigned long head, tail;
+
+   head = __atomic_load_n (&(ring -> head), __ATOMIC_ACQUIRE);
+   tail = __atomic_load_n (&(ring -> tail), __ATOMIC_ACQUIRE);
+
+   if (for_write)
+      return tail - head < (ring -> capacity) ||
+	     __atomic_load_n (&(ring -> abandoned), __ATOMIC_ACQUIRE);
+
+   return head != tail ||
+	  __atomic_load_n (&(ring -> closed), __ATOMIC_ACQUIRE);
+}
+
+void ram_ring_close (RAM_Ring *ring)
+{
+   __atomic_store_n (&(ring -> closed), 1, __ATOMIC_RELEASE);
+}
+
+void ram_ring_abandon (RAM_Ring *ring)
+{
+   __atomic_store_n (&(ring -> abandoned), 1, __ATOMIC_RELEASE);
+}
+
+void ram_ring_release (RAM *machine)
+{
+   if (machine -> output_ring)
+      ram_ring_close (machine -> output_ring);
+   if (machine -> input_ring)
+      ram_ring_abandon (machine -> input_ring);
+}
+
+int ram_tape_bind_ring (RAM *machine, const char *name, RAM_Ring *ring)
+{
+   unsigned int i;
+
+   for (i = 0; i < (machine -> tape_count); i ++)
+      if (!strcmp ((machine -> tapes) [i].name, name))
+      {
+	 (machine -> tapes) [i].ring = ring;
+	 return 1;
+      }
+
+   return 0;
+}
+
+RAM_Pipeline *ram_pipeline_new (RAM **machines, unsigned int n,
+				unsigned long capacity)
+{
+   RAM_Pipeline *pipeline;
+   unsigned int i;
+
+   pipeline = (RAM_Pipeline *) calloc (1, sizeof (RAM_Pipeline));
+   if (!pipeline)
+      err_fatal_perror ("calloc",
+		      "could not allocate RAM_Pipeline structure");
+
+   (pipeline -> machines) = (RAM **) malloc (n * sizeof (RAM *));
+   (pipeline -> rings) = (RAM_Ring **) calloc (n, sizeof (RAM_Ring *));
+   (pipeline -> threads) = (pthread_t *) malloc (n * sizeof (pthread_t));
+   (pipeline -> halted) = (int *) calloc (n, sizeof (int));
+   if (!(pipeline -> machines) || !(pipeline -> rings) ||
+       !(pipeline -> threads) || !(pipeline -> halted))
+      err_fatal_perror ("malloc", "could not allocate pipeline of %u", n);
+
+   memcpy ((pipeline -> machines), machines, n * sizeof (RAM *));
+   (pipeline -> n) = n;
+
+   for (i = 0; i + 1 < n; i ++)
+   {
+      (pipeline -> rings) [i] = ram_ring_new (capacity);
+
+      (machines [i] -> output_ring) = (pipeline -> rings) [i];
+      (machines [i + 1] -> input_ring) = (pipeline -> rings) [i];
+   }
+
+   return pipeline;
+}
+
+void ram_pipeline_delete (RAM_Pipeline *pipeline)
+{
+   unsigned int i;
+
+   for (i = 0; i + 1 < (pipeline -> n); i ++)
+   {
+      (pipeline -> machines [i] -> output_ring) = NULL;
+      (pipeline -> machines [i + 1] -> input_ring) = NULL;
+
+      ram_ring_delete ((pipeline -> rings) [i]);
+   }
+
+   free (pipeline -> machines);
+   free (pipeline -> rings);
+   free (pipeline -> threads);
+   free (pipeline -> halted);
+   free (pipeline);
+}
+
+typedef struct
+{
+   RAM_Pipeline *pipeline;
+   unsigned int index;
+}
+Stage;
+
+static void *stage_thread (void *data)
+{
+   Stage *stage = (Stage *) data;
+   RAM *machine = (stage -> pipeline -> machines) [stage -> index];
+   unsigned int spins = 0;
+
+   for (;;)
+   {
+      if (ram_run (machine, STAGE_STEPS))
+	 spins = 0;
+      else if (machine -> waiting)
+	 backoff (&spins);
+      else
+	 break;
+   }
+
+   (stage -> pipeline -> halted) [stage -> index] =
+	   !ram_is_running (machine);
+
+   ram_ring_release (machine);
+
+   return NULL;
+}
+
+int ram_pipeline_run (RAM_Pipeline *pipeline)
+{
+   Stage *stages;
+   unsigned int i;
+   int halted = 1;
+
+   stages = (Stage *) malloc ((pipeline -> n) * sizeof (Stage));
+   if (!stages)
+      err_fatal_perror ("malloc", "could not allocate %u stages",
+		      (pipeline -> n));
+
+   for (i = 0; i < (pipeline -> n); i ++)
+   {
+      (stages [i].pipeline) = pipeline;
+      (stages [i].index) = i;
+
+      if (pthread_create ((pipeline -> threads) + i, NULL, stage_thread,
+			      stages + i))
+	 err_fatal_perror ("pthread_create",
+			 "could not start pipeline stage %u", i);
+   }
+
+   for (i = 0; i < (pipeline -> n); i ++)
+   {
+      pthread_join ((pipeline -> threads) [i], NULL);
+      halted = halted && (pipeline -> halted) [i];
+   }
+
+   free (stages);
+
+   return halted;
+}
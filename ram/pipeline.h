@@ -0,0 +1,51 @@
+#ifndef RAM_PIPELINE_H
+#define RAM_PIPELINE_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include "ram.h"
+
+
+struct _RAM_Ring
+{
+   mpz_t *values;
+   unsigned long capacity;
+
+   unsigned long head __attribute__ ((aligned (64)));
+   unsigned long tail __attribute__ ((aligned (64)));
+   int closed, abandoned;
+};
+
+typedef struct
+{
+   RAM **machines;
+   unsigned int n;
+
+   RAM_Ring **rings;
+   pthread_t *threads;
+   int *halted;
+}
+RAM_Pipeline;
+
+RAM_Ring *ram_ring_new (unsigned long capacity);
+void ram_ring_delete (RAM_Ring *);
+
+int ram_ring_try_put (RAM_Ring *, mpz_t);
+int ram_ring_try_get (RAM_Ring *, mpz_t);
+int ram_ring_put (RAM_Ring *, mpz_t);
+int ram_ring_get (RAM_Ring *, mpz_t);
+int ram_ring_ready (RAM_Ring *, int for_write);
+void ram_ring_close (RAM_Ring *);
+void ram_ring_abandon (RAM_Ring *);
+void ram_ring_release (RAM *);
+
+int ram_tape_bind_ring (RAM *, const char *name, RAM_Ring *);
+
+RAM_Pipeline *ram_pipeline_new (RAM **machines, unsigned int n,
+				unsigned long capacity);
+void ram_pipeline_delete (RAM_Pipeline *);
+
+int ram_pipeline_run (RAM_Pipeline *);
+
+#endif
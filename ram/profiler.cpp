@@ -0,0 +1,258 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <sched.h>
+#include <sys/time.h>
+#include <gmp.h>
+#include "profiler.h"
+
+/* SIGPROF fires every interval of CPU time and the handler charges one
+   sample to the current instruction of the machine running on the
+   interrupted thread.  That machine is found through the thread's
+   current arena, which the engine already sets around every step, so
+   profiling adds nothing to the execution loop.  Compiled programs
+   store current_instruction at every instruction for the same reason;
+   code that kept it only on exit would charge every sample to the
+   instruction it was entered at.  Samples taken while no profiled
+   machine is running are counted as outside.  So are the ones that land
+   while a running machine has stepped out of its arena: the pipeline
+   and the checkpoint code leave it for NULL while they queue or copy
+   registers, and the engine does the same to update the step and time
+   counters, so a profile of a machine fed through a pipeline or
+   checkpointed often shows part of that time as outside.
+
+   The handler can run on any thread, so active is only read and written
+   atomically, and entering counts the handlers in flight: stopping
+   clears active and then waits for that count to drop to zero, after
+   which no handler holds the profiler and it may be freed. */
+
+static RAM_Profiler *active;
+static unsigned int in_handler;
+
+static void profile_signal (int)
+{
+   RAM_Profiler *prof;
+   RAM_Arena *arena = ram_arena_current ();
+   unsigned int i, count;
+
+   __atomic_add_fetch (&in_handler, 1, __ATOMIC_SEQ_CST);
+
+   prof = __atomic_load_n (&active, __ATOMIC_SEQ_CST);
+   if (!prof)
+      goto out;
+
+   __atomic_add_fetch (&(prof -> samples), 1, __ATOMIC_RELAXED);
+
+   count = __atomic_load_n (&(prof -> count), __ATOMIC_ACQUIRE);
+   for (i = 0; arena && i < count; i ++)
+   {
+      RAM_ProfiledMachine *pm = (prof -> machines) + i;
+      unsigned int ci;
+
+      if ((pm -> arena) != arena)
+	 continue;
+
+      ci = (pm -> machine -> current_instruction);
+      if (ci < (pm -> machine -> program -> n))
+	 __atomic_add_fetch ((pm -> hits) + ci, 1, __ATOMIC_RELAXED);
+      __atomic_add_fetch (&(pm -> samples), 1, __ATOMIC_RELAXED);
+
+      goto out;
+   }
+
+   __atomic_add_fetch (&(prof -> outside), 1, __ATOMIC_RELAXED);
+
+out:
+   __atomic_sub_fetch (&in_handler, 1, __ATOMIC_SEQ_CST);
+}
+
+RAM_Profiler *ram_profiler_new (unsigned long interval_us)
+{
+   RAM_Profiler *prof;
+
+   prof = (RAM_Profiler *) calloc (1, sizeof (RAM_Profiler));
+   if (!prof)
+      err_fatal_perror ("calloc", "could not allocate RAM_Profiler structure");
+
+   (prof -> interval) = interval_us ? interval_us : 1000;
+
+   return prof;
+}
+
+void ram_profiler_delete (RAM_Profiler *prof)
+{
+   unsigned int i;
+
+   if (prof -> running)
+      ram_profiler_stop (prof);
+
+   for (i = 0; i < (prof -> count); i ++)
+      free ((prof -> machines) [i].hits);
+
+   free (prof);
+}
+
+int ram_profiler_add (RAM_Profiler *prof, RAM *machine)
+{
+   RAM_ProfiledMachine *pm;
+
+   if ((prof -> count) == RAM_PROFILER_MACHINES)
+      return 0;
+
+   pm = (prof -> machines) + (prof -> count);
+   (pm -> machine) = machine;
+   (pm -> arena) = (machine -> memory -> arena);
+   (pm -> samples) = 0;
+   (pm -> hits) = (unsigned long *)
+	   calloc ((machine -> program -> n) + 1, sizeof (unsigned long));
+   if (!(pm -> hits))
+      err_fatal_perror ("calloc", "could not allocate profile of %d",
+		      (machine -> program -> n));
+
+   __atomic_store_n (&(prof -> count), (prof -> count) + 1,
+		   __ATOMIC_RELEASE);
+
+   return 1;
+}
+
+int ram_profiler_start (RAM_Profiler *prof)
+{
+   struct sigaction action;
+   struct itimerval timer;
+   RAM_Profiler *none = NULL;
+
+   if (!__atomic_compare_exchange_n (&active, &none, prof, 0,
+				     __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))
+      return 0;
+
+   memset (&action, 0, sizeof (action));
+   action.sa_handler = profile_signal;
+   action.sa_flags = SA_RESTART;
+   sigemptyset (&action.sa_mask);
+   if (sigaction (SIGPROF, &action, &(prof -> previous)))
+   {
+      __atomic_store_n (&active, NULL, __ATOMIC_SEQ_CST);
+      return 0;
+   }
+
+   (prof -> running) = 1;
+
+   timer.it_interval.tv_sec = (prof -> interval) / 1000000;
+   timer.it_interval.tv_usec = (prof -> interval) % 1000000;
+   timer.it_value = timer.it_interval;
+   if (setitimer (ITIMER_PROF, &timer, NULL))
+   {
+      ram_profiler_stop (prof);
+      return 0;
+   }
+
+   return 1;
+}
+
+void ram_profiler_stop (RAM_Profiler *prof)
+{
+   struct itimerval timer;
+
+   if (!(prof -> running))
+      return;
+
+   memset (&timer, 0, sizeof (timer));
+   setitimer (ITIMER_PROF, &timer, NULL);
+
+   /* A signal already pending on another thread may still be delivered,
+      so the handler stays installed until every one in flight is done
+      with prof. */
+   __atomic_store_n (&active, NULL, __ATOMIC_SEQ_CST);
+   while (__atomic_load_n (&in_handler, __ATOMIC_SEQ_CST))
+      sched_yield ();
+
+   sigaction (SIGPROF, &(prof -> previous), NULL);
+   (prof -> running) = 0;
+}
+
+static const char *label_of (RAM_Program *program, unsigned int instruction)
+{
+   const char *name = NULL;
+   unsigned int i, best = 0;
+
+   for (i = 0; i < (program -> label_count); i ++)
+   {
+      unsigned int at = (program -> labels) [i].instruction;
+
+      if (at <= instruction + 1 && at > best)
+      {
+	 best = at;
+	 name = (program -> labels) [i].name;
+      }
+   }
+
+   return name ? name : "(start)";
+}
+
+static unsigned int line_of (RAM_Program *program, unsigned int instruction)
+{
+   if (instruction < (program -> lines_size) && (program -> lines) [instruction])
+      return (program -> lines) [instruction];
+
+   return instruction + 1;
+}
+
+void ram_profiler_report (RAM_Profiler *prof, FILE *out)
+{
+   unsigned int m, i, j;
+
+   fprintf (out, "profile: %lu samples every %lu us, %lu outside machines\n",
+		   (prof -> samples), (prof -> interval), (prof -> outside));
+
+   for (m = 0; m < (prof -> count); m ++)
+   {
+      RAM_ProfiledMachine *pm = (prof -> machines) + m;
+      RAM_Program *program = (pm -> machine -> program);
+
+      fprintf (out, "machine %u: %lu samples\n", m, (pm -> samples));
+      if (!(pm -> samples))
+	 continue;
+
+      for (i = 0; i < (program -> n); i = j)
+      {
+	 const char *label = label_of (program, i);
+	 unsigned long hits = 0;
+
+	 for (j = i; j < (program -> n) && label_of (program, j) == label; j ++)
+	    hits += (pm -> hits) [j];
+
+	 if (!hits)
+	    continue;
+
+	 fprintf (out, "  %-20s %8lu %6.2f%%\n", label, hits,
+			 100.0 * hits / (pm -> samples));
+
+	 for (j = i; j < (program -> n) && label_of (program, j) == label; j ++)
+	    if ((pm -> hits) [j])
+	       fprintf (out, "    line %-13u %8lu %6.2f%%\n",
+			       line_of (program, j), (pm -> hits) [j],
+			       100.0 * (pm -> hits) [j] / (pm -> samples));
+      }
+   }
+}
+
+void ram_profiler_report_folded (RAM_Profiler *prof, FILE *out)
+{
+   unsigned int m, i;
+
+   for (m = 0; m < (prof -> count); m ++)
+   {
+      RAM_ProfiledMachine *pm = (prof -> machines) + m;
+      RAM_Program *program = (pm -> machine -> program);
+
+      for (i = 0; i < (program -> n); i ++)
+	 if ((pm -> hits) [i])
+	    fprintf (out, "machine%u;%s;line %u %lu\n", m,
+			    label_of (program, i), line_of (program, i),
+			    (pm -> hits) [i]);
+   }
+
+   if (prof -> outside)
+      fprintf (out, "outside %lu\n", (prof -> outside));
+}
@@ -0,0 +1,43 @@
+#ifndef RAM_PROFILER_H
+#define RAM_PROFILER_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <signal.h>
+#include "ram.h"
+
+
+#define RAM_PROFILER_MACHINES 64
+
+typedef struct
+{
+   RAM *machine;
+   RAM_Arena *arena;
+   unsigned long *hits;
+   unsigned long samples;
+}
+RAM_ProfiledMachine;
+
+typedef struct
+{
+   RAM_ProfiledMachine machines [RAM_PROFILER_MACHINES];
+   unsigned int count;
+
+   unsigned long interval, samples, outside;
+   int running;
+   struct sigaction previous;
+}
+RAM_Profiler;
+
+RAM_Profiler *ram_profiler_new (unsigned long interval_us);
+void ram_profiler_delete (RAM_Profiler *);
+
+int ram_profiler_add (RAM_Profiler *, RAM *);
+
+int ram_profiler_start (RAM_Profiler *);
+void ram_profiler_stop (RAM_Profiler *);
+
+void ram_profiler_report (RAM_Profiler *, FILE *);
+void ram_profiler_report_folded (RAM_Profiler *, FILE *);
+
+#endif
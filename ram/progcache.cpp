@@ -0,0 +1,402 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <gmp.h>
+#include "progcache.h"
+
+/* The program cache keeps parsed programs as flat images in DIR, one
+   file per key, so that processes on the same host can map a program
+   read-only instead of parsing it again; the page cache then holds a
+   single copy for all of them.  The key is normally the content hash
+   of the source file.  An image is written to a temporary file and
+   renamed into place, so concurrent writers of the same key and
+   readers still mapping a replaced file are both safe.
+
+   image:  header { instruction:u32 type:u32 size:i64 limb:u64 }
+	   limbs { line:u32 } { instruction:u32 name:u32 } { name:u32 }
+	   strings
+
+   The layout is the host's own; an image is not meant to leave the
+   machine that wrote it.  Parameters of an attached program are
+   mpz_roinit_n views of the mapped limbs; the functions that modify a
+   program first copy it out of the mapping with ram_program_unshare,
+   so optimize it before storing it rather than after attaching. */
+
+#define CACHE_VERSION 1
+
+typedef struct
+{
+   char magic [4];
+   unsigned int version;
+   unsigned long key, hash, size;
+   unsigned int n, tape_count, label_count, lines_size;
+   unsigned long limbs, strings;
+}
+CacheHeader;
+
+typedef struct
+{
+   unsigned int instruction, parameter_type;
+   long size;
+   unsigned long limb;
+}
+CacheInstruction;
+
+typedef struct
+{
+   unsigned int instruction, name;
+}
+CacheLabel;
+
+static const char CACHE_MAGIC [] = "RAMP";
+
+unsigned long ram_program_cache_key (const char *source)
+{
+   unsigned char buf [16384];
+   unsigned long hash = 14695981039346656037UL;
+   size_t got, i;
+   FILE *f;
+
+   f = fopen (source, "rb");
+   if (!f)
+      return 0;
+
+   while ((got = fread (buf, 1, sizeof (buf), f)) > 0)
+      for (i = 0; i < got; i ++)
+	 hash = (hash ^ buf [i]) * 1099511628211UL;
+
+   if (ferror (f))
+      hash = 0;
+   fclose (f);
+
+   return hash;
+}
+
+static char *cache_path (const char *dir, unsigned long key)
+{
+   char *path;
+
+   path = (char *) malloc (strlen (dir) + 32);
+   if (!path)
+      err_fatal_perror ("malloc", "could not allocate cache path");
+
+   sprintf (path, "%s/%016lx.ramp", dir, key);
+
+   return path;
+}
+
+int ram_program_cache_store (RAM_Program *rp, const char *dir,
+				unsigned long key)
+{
+   CacheHeader h;
+   unsigned long limbs = 0, strings = 0, offset;
+   unsigned int i;
+   char *path, *temp;
+   FILE *f;
+   int fd, ok;
+
+   for (i = 0; i < (rp -> n); i ++)
+      if (((rp -> instructions) [i] -> parameter_type) != RAM_NO_PARAMETER)
+	 limbs += mpz_size ((rp -> instructions) [i] -> parameter);
+   for (i = 0; i < (rp -> label_count); i ++)
+      strings += strlen ((rp -> labels) [i].name) + 1;
+   for (i = 0; i < (rp -> tape_count); i ++)
+      strings += strlen ((rp -> tape_names) [i]) + 1;
+
+   memset (&h, 0, sizeof (h));
+   memcpy ((h.magic), CACHE_MAGIC, 4);
+   (h.version) = CACHE_VERSION;
+   (h.key) = key;
+   (h.hash) = ram_program_hash (rp);
+   (h.n) = (rp -> n);
+   (h.tape_count) = (rp -> tape_count);
+   (h.label_count) = (rp -> label_count);
+   (h.lines_size) = (rp -> lines) ? (rp -> lines_size) : 0;
+   (h.limbs) = limbs;
+   (h.strings) = strings;
+   (h.size) = sizeof (h) + (h.n) * sizeof (CacheInstruction) +
+	   limbs * sizeof (mp_limb_t) + (h.lines_size) * sizeof (unsigned int) +
+	   (h.label_count) * sizeof (CacheLabel) +
+	   (h.tape_count) * sizeof (unsigned int) + strings;
+
+   path = cache_path (dir, key);
+   temp = (char *) malloc (strlen (path) + 8);
+   if (!temp)
+      err_fatal_perror ("malloc", "could not allocate cache path");
+   sprintf (temp, "%s.XXXXXX", path);
+
+   fd = mkstemp (temp);
+   if (fd < 0 || !(f = fdopen (fd, "wb")))
+   {
+      if (fd >= 0)
+      {
+	 close (fd);
+	 unlink (temp);
+      }
+      free (temp);
+      free (path);
+      return 0;
+   }
+   fchmod (fd, 0644);
+
+   fwrite (&h, sizeof (h), 1, f);
+
+   for (i = 0, offset = 0; i < (rp -> n); i ++)
+   {
+      RAM_Instruction *ri = (rp -> instructions) [i];
+      CacheInstruction ci;
+
+      (ci.instruction) = (ri -> instruction);
+      (ci.parameter_type) = (ri -> parameter_type);
+      (ci.size) = (ci.parameter_type) != RAM_NO_PARAMETER ?
+	      (ri -> parameter -> _mp_size) : 0;
+      (ci.limb) = offset;
+      offset += (ci.size) < 0 ? - (ci.size) : (ci.size);
+
+      fwrite (&ci, sizeof (ci), 1, f);
+   }
+
+   for (i = 0; i < (rp -> n); i ++)
+      if (((rp -> instructions) [i] -> parameter_type) != RAM_NO_PARAMETER)
+	 fwrite (mpz_limbs_read ((rp -> instructions) [i] -> parameter),
+		 sizeof (mp_limb_t),
+		 mpz_size ((rp -> instructions) [i] -> parameter), f);
+
+   if (h.lines_size)
+      fwrite ((rp -> lines), sizeof (unsigned int), (h.lines_size), f);
+
+   offset = 0;
+   for (i = 0; i < (rp -> label_count); i ++)
+   {
+      CacheLabel cl;
+
+      (cl.instruction) = (rp -> labels) [i].instruction;
+      (cl.name) = offset;
+      offset += strlen ((rp -> labels) [i].name) + 1;
+
+      fwrite (&cl, sizeof (cl), 1, f);
+   }
+
+   for (i = 0; i < (rp -> tape_count); i ++)
+   {
+      unsigned int name = offset;
+
+      offset += strlen ((rp -> tape_names) [i]) + 1;
+      fwrite (&name, sizeof (name), 1, f);
+   }
+
+   for (i = 0; i < (rp -> label_count); i ++)
+      fwrite ((rp -> labels) [i].name, 1,
+		      strlen ((rp -> labels) [i].name) + 1, f);
+   for (i = 0; i < (rp -> tape_count); i ++)
+      fwrite ((rp -> tape_names) [i], 1,
+		      strlen ((rp -> tape_names) [i]) + 1, f);
+
+   ok = !ferror (f);
+   ok = !fclose (f) && ok;
+   if (ok && rename (temp, path))
+      ok = 0;
+   if (!ok)
+      unlink (temp);
+
+   free (temp);
+   free (path);
+
+   return ok;
+}
+
+/* Everything in an image is checked against the mapped size before
+   any of it is used, so a truncated or foreign file is refused rather
+   than read out of bounds. */
+
+static int valid_image (const unsigned char *map, size_t size,
+				unsigned long key)
+{
+   const CacheHeader *h = (const CacheHeader *) map;
+   const CacheInstruction *ci;
+   const CacheLabel *cl;
+   const unsigned int *tapes;
+   unsigned long need;
+   unsigned int i;
+
+   if (memcmp ((h -> magic), CACHE_MAGIC, 4) ||
+       (h -> version) != CACHE_VERSION || (h -> key) != key ||
+       (h -> size) != size)
+      return 0;
+
+   if ((h -> n) > size / sizeof (CacheInstruction) ||
+       (h -> limbs) > size / sizeof (mp_limb_t) ||
+       (h -> lines_size) > size / sizeof (unsigned int) ||
+       (h -> label_count) > size / sizeof (CacheLabel) ||
+       (h -> tape_count) > size / sizeof (unsigned int) ||
+       (h -> strings) > size)
+      return 0;
+
+   need = sizeof (CacheHeader) + (h -> n) * sizeof (CacheInstruction) +
+	   (h -> limbs) * sizeof (mp_limb_t) +
+	   (h -> lines_size) * sizeof (unsigned int) +
+	   (h -> label_count) * sizeof (CacheLabel) +
+	   (h -> tape_count) * sizeof (unsigned int) + (h -> strings);
+   if (need != size)
+      return 0;
+
+   if ((h -> strings) && map [size - 1])
+      return 0;
+
+   ci = (const CacheInstruction *) (map + sizeof (CacheHeader));
+   for (i = 0; i < (h -> n); i ++)
+   {
+      unsigned long limbs = (ci [i].size) < 0 ?
+	      - (unsigned long) (ci [i].size) : (unsigned long) (ci [i].size);
+
+      if (ci [i].instruction > RAM_HALT || ci [i].parameter_type > RAM_TAPE)
+	 return 0;
+      if (ci [i].parameter_type == RAM_NO_PARAMETER && limbs)
+	 return 0;
+      if (ci [i].limb > (h -> limbs) || limbs > (h -> limbs) - ci [i].limb)
+	 return 0;
+   }
+
+   cl = (const CacheLabel *) (map + size - (h -> strings) -
+		   (h -> tape_count) * sizeof (unsigned int) -
+		   (h -> label_count) * sizeof (CacheLabel));
+   for (i = 0; i < (h -> label_count); i ++)
+      if (cl [i].name >= (h -> strings) || cl [i].instruction > (h -> n))
+	 return 0;
+
+   tapes = (const unsigned int *) (cl + (h -> label_count));
+   for (i = 0; i < (h -> tape_count); i ++)
+      if (tapes [i] >= (h -> strings))
+	 return 0;
+
+   return 1;
+}
+
+static RAM_Program *build_program (unsigned char *map, size_t size)
+{
+   CacheHeader *h = (CacheHeader *) map;
+   CacheInstruction *ci;
+   CacheLabel *cl;
+   mp_limb_t *limbs;
+   unsigned int *tapes;
+   char *strings;
+   RAM_Instruction *cells;
+   RAM_Program *rp;
+   unsigned int i;
+
+   ci = (CacheInstruction *) (map + sizeof (CacheHeader));
+   limbs = (mp_limb_t *) (ci + (h -> n));
+   strings = (char *) map + size - (h -> strings);
+   tapes = (unsigned int *) strings - (h -> tape_count);
+   cl = (CacheLabel *) tapes - (h -> label_count);
+
+   rp = ram_program_new ();
+   (rp -> n) = (h -> n);
+
+   if (h -> n)
+   {
+      (rp -> instructions) = (RAM_Instruction **)
+	      malloc ((h -> n) * sizeof (RAM_Instruction *));
+      cells = (RAM_Instruction *) malloc ((h -> n) * sizeof (RAM_Instruction));
+      if (!(rp -> instructions) || !cells)
+	 err_fatal_perror ("malloc", "could not allocate %u instructions",
+			 (h -> n));
+
+      for (i = 0; i < (h -> n); i ++)
+      {
+	 cells [i].instruction = (RAM_InstructionType) ci [i].instruction;
+	 cells [i].parameter_type = (RAM_ParameterType) ci [i].parameter_type;
+	 if (cells [i].parameter_type != RAM_NO_PARAMETER)
+	    mpz_roinit_n (cells [i].parameter, limbs + ci [i].limb,
+			    ci [i].size);
+
+	 (rp -> instructions) [i] = cells + i;
+      }
+   }
+
+   if (h -> lines_size)
+   {
+      (rp -> lines) = (unsigned int *) (limbs + (h -> limbs));
+      (rp -> lines_size) = (h -> lines_size);
+   }
+
+   if (h -> label_count)
+   {
+      (rp -> labels) = (RAM_Label *)
+	      malloc ((h -> label_count) * sizeof (RAM_Label));
+      if (!(rp -> labels))
+	 err_fatal_perror ("malloc", "could not allocate %u labels",
+			 (h -> label_count));
+
+      for (i = 0; i < (h -> label_count); i ++)
+      {
+	 (rp -> labels) [i].name = strings + cl [i].name;
+	 (rp -> labels) [i].instruction = cl [i].instruction;
+      }
+      (rp -> label_count) = (h -> label_count);
+   }
+
+   if (h -> tape_count)
+   {
+      (rp -> tape_names) = (char **)
+	      malloc ((h -> tape_count) * sizeof (char *));
+      if (!(rp -> tape_names))
+	 err_fatal_perror ("malloc", "could not allocate %u tapes",
+			 (h -> tape_count));
+
+      for (i = 0; i < (h -> tape_count); i ++)
+	 (rp -> tape_names) [i] = strings + tapes [i];
+      (rp -> tape_count) = (h -> tape_count);
+   }
+
+   (rp -> mapping) = map;
+   (rp -> mapping_size) = size;
+
+   return rp;
+}
+
+RAM_Program *ram_program_cache_attach (const char *dir, unsigned long key)
+{
+   struct stat st;
+   unsigned char *map;
+   RAM_Program *rp;
+   char *path;
+   int fd;
+
+   path = cache_path (dir, key);
+   fd = open (path, O_RDONLY);
+   free (path);
+   if (fd < 0)
+      return NULL;
+
+   if (fstat (fd, &st) || (size_t) (st.st_size) < sizeof (CacheHeader))
+   {
+      close (fd);
+      return NULL;
+   }
+
+   map = (unsigned char *) mmap (NULL, (st.st_size), PROT_READ, MAP_SHARED,
+		   fd, 0);
+   close (fd);
+   if (map == (unsigned char *) MAP_FAILED)
+      return NULL;
+
+   if (!valid_image (map, (st.st_size), key))
+   {
+      munmap (map, (st.st_size));
+      return NULL;
+   }
+
+   rp = build_program (map, (st.st_size));
+   if (ram_program_hash (rp) != ((CacheHeader *) map) -> hash)
+   {
+      ram_program_delete (rp);
+      return NULL;
+   }
+
+   return rp;
+}
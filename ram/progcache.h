@@ -0,0 +1,15 @@
+#ifndef RAM_PROGCACHE_H
+#define RAM_PROGCACHE_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "ram.h"
+
+
+unsigned long ram_program_cache_key (const char *source);
+
+int ram_program_cache_store (RAM_Program *, const char *dir,
+				unsigned long key);
+RAM_Program *ram_program_cache_attach (const char *dir, unsigned long key);
+
+#endif
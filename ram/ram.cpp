@@ -1,10 +1,17 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdarg.h>
+#include <string.h>
+#include <sys/mman.h>
 #include <gmp.h>
 #include "ram.h"
 
 
+const char *ram_instruction_names [] =
+{
+   "none", "read", "write", "load", "store", "add", "neg", "half",
+   "jump", "jgtz", "halt"
+};
 
 RAM_Instruction *ram_instruction_new ()
 {
@@ -38,8 +45,91 @@ RAM_Program *ram_program_new ()
    return rp;
 }
 
+/* A program attached from the program cache points into a read-only
+   mapping: its parameters, names and lines are not owned by it, only
+   the arrays built around them on attach. */
+
+static void ram_program_detach (RAM_Program *rp)
+{
+   if (rp -> n)
+      free ((rp -> instructions) [0]);
+   free (rp -> instructions);
+   free (rp -> tape_names);
+   free (rp -> labels);
+
+   munmap ((rp -> mapping), (rp -> mapping_size));
+   (rp -> mapping) = NULL;
+}
+
+/* Copies an attached program out of its mapping so that it can be
+   changed; the functions that modify a program call it first. */
+void ram_program_unshare (RAM_Program *rp)
+{
+   RAM_Instruction **instructions = NULL;
+   unsigned int *lines = NULL;
+   unsigned int i;
+
+   if (!(rp -> mapping))
+      return;
+
+   if (rp -> n)
+   {
+      instructions = (RAM_Instruction **)
+	      malloc ((rp -> n) * sizeof (RAM_Instruction *));
+      if (!instructions)
+	 err_fatal_perror ("malloc", "could not copy %u instructions",
+			 (rp -> n));
+
+      for (i = 0; i < (rp -> n); i ++)
+      {
+	 RAM_Instruction *from = (rp -> instructions) [i], *to;
+
+	 to = ram_instruction_new ();
+	 (to -> instruction) = (from -> instruction);
+	 (to -> parameter_type) = (from -> parameter_type);
+	 if ((to -> parameter_type) != RAM_NO_PARAMETER)
+	    mpz_init_set ((to -> parameter), (from -> parameter));
+
+	 instructions [i] = to;
+      }
+   }
+
+   if (rp -> lines_size)
+   {
+      lines = (unsigned int *)
+	      malloc ((rp -> lines_size) * sizeof (unsigned int));
+      if (!lines)
+	 err_fatal_perror ("malloc", "could not copy %u source lines",
+			 (rp -> lines_size));
+
+      memcpy (lines, (rp -> lines),
+		      (rp -> lines_size) * sizeof (unsigned int));
+   }
+
+   for (i = 0; i < (rp -> label_count); i ++)
+      (rp -> labels) [i].name = strdup ((rp -> labels) [i].name);
+   for (i = 0; i < (rp -> tape_count); i ++)
+      (rp -> tape_names) [i] = strdup ((rp -> tape_names) [i]);
+
+   if (rp -> n)
+      free ((rp -> instructions) [0]);
+   free (rp -> instructions);
+   munmap ((rp -> mapping), (rp -> mapping_size));
+
+   (rp -> instructions) = instructions;
+   (rp -> lines) = lines;
+   (rp -> mapping) = NULL;
+   (rp -> mapping_size) = 0;
+}
+
 void ram_program_clear (RAM_Program *rp)
 {
+   if (rp -> mapping)
+   {
+      ram_program_detach (rp);
+      return;
+   }
+
    if (rp -> instructions)
    {
       int i;
@@ -48,6 +138,28 @@ void ram_program_clear (RAM_Program *rp)
 	 if ((rp -> instructions) [i])
 	    ram_instruction_clear ((rp -> instructions) [i]);
    }
+
+   if (rp -> tape_names)
+   {
+      unsigned int i;
+
+      for (i = 0; i < (rp -> tape_count); i ++)
+	 free ((rp -> tape_names) [i]);
+
+      free (rp -> tape_names);
+   }
+
+   free (rp -> lines);
+
+   if (rp -> labels)
+   {
+      unsigned int i;
+
+      for (i = 0; i < (rp -> label_count); i ++)
+	 free ((rp -> labels) [i].name);
+
+      free (rp -> labels);
+   }
 }
 
 void ram_program_delete (RAM_Program *rp)
@@ -56,6 +168,102 @@ void ram_program_delete (RAM_Program *rp)
    free (rp);
 }
 
+unsigned long ram_program_hash (RAM_Program *rp)
+{
+   unsigned long hash = 14695981039346656037UL;
+   unsigned int i;
+
+#define HASH_WORD(w) (hash = (hash ^ (unsigned long) (w)) * 1099511628211UL)
+
+   HASH_WORD (rp -> n);
+   for (i = 0; i < (rp -> n); i ++)
+   {
+      RAM_Instruction *ri = (rp -> instructions) [i];
+
+      HASH_WORD (ri -> instruction);
+      HASH_WORD (ri -> parameter_type);
+      if ((ri -> parameter_type) != RAM_NO_PARAMETER)
+      {
+	 size_t j, size = mpz_size (ri -> parameter);
+
+	 HASH_WORD (mpz_sgn (ri -> parameter));
+	 for (j = 0; j < size; j ++)
+	    HASH_WORD (mpz_getlimbn ((ri -> parameter), j));
+      }
+   }
+
+#undef HASH_WORD
+
+   return hash;
+}
+
+void ram_program_set_line (RAM_Program *rp, unsigned int instruction,
+				unsigned int line)
+{
+   ram_program_unshare (rp);
+
+   if (instruction > (rp -> lines_size))
+   {
+      unsigned int size = (rp -> lines_size) ? (rp -> lines_size) : 64;
+
+      while (size < instruction)
+	 size *= 2;
+
+      (rp -> lines) = (unsigned int *) realloc ((rp -> lines),
+		      size * sizeof (unsigned int));
+      if (!(rp -> lines))
+	 err_fatal_perror ("realloc", "could not store %d source lines",
+			 size);
+
+      memset ((rp -> lines) + (rp -> lines_size), 0,
+		      (size - (rp -> lines_size)) * sizeof (unsigned int));
+      (rp -> lines_size) = size;
+   }
+
+   (rp -> lines) [instruction - 1] = line;
+}
+
+void ram_program_add_label (RAM_Program *rp, const char *name,
+				unsigned int instruction)
+{
+   RAM_Label *label;
+   size_t length = strcspn (name, ":");
+
+   ram_program_unshare (rp);
+
+   (rp -> labels) = (RAM_Label *) realloc ((rp -> labels),
+		   ((rp -> label_count) + 1) * sizeof (RAM_Label));
+   if (!(rp -> labels))
+      err_fatal_perror ("realloc", "could not add label %s", name);
+
+   label = (rp -> labels) + (rp -> label_count) ++;
+   (label -> name) = strndup (name, length);
+   (label -> instruction) = instruction;
+}
+
+unsigned int ram_program_find_label (RAM_Program *rp, const char *name)
+{
+   unsigned int i;
+
+   for (i = 0; i < (rp -> label_count); i ++)
+      if (!strcmp ((rp -> labels) [i].name, name))
+	 return (rp -> labels) [i].instruction;
+
+   return 0;
+}
+
+unsigned int ram_program_find_line (RAM_Program *rp, unsigned int line)
+{
+   unsigned int i, best = 0;
+
+   for (i = 0; i < (rp -> lines_size) && i < (rp -> n); i ++)
+      if ((rp -> lines) [i] >= line && (rp -> lines) [i] &&
+	  (!best || (rp -> lines) [i] < (rp -> lines) [best - 1]))
+	 best = i + 1;
+
+   return best;
+}
+
 RAM *ram_new ()
 {
    RAM *rm;
@@ -66,6 +274,7 @@ RAM *ram_new ()
 
    (rm -> input) = stdin;
    (rm -> output) = stdout;
+   (rm -> encoding) = RAM_TAPE_TEXT;
 
    (rm -> memory) = ram_memory_new ();
 
@@ -86,13 +295,20 @@ void ram_clear (RAM *rm)
       (rm -> program) = NULL;
    }
 
+   mpz_set_ui ((rm -> instructions_done), 0);
+   mpz_set_ui ((rm -> time_consumed), 0);
+
+   free (rm -> operands);
+   (rm -> operands) = NULL;
+
+   free (rm -> tapes);
+   (rm -> tapes) = NULL;
+   (rm -> tape_count) = 0;
+
    if (rm -> memory)
       ram_memory_delete (rm -> memory);
 
    (rm -> memory) = NULL;
-
-   mpz_set_ui ((rm -> instructions_done), 0);
-   mpz_set_ui ((rm -> time_consumed), 0);
 }
 
 void ram_delete (RAM *rm)
@@ -108,7 +324,7 @@ void ram_delete (RAM *rm)
 void ram_reset (RAM *rm)
 {
    ram_memory_reset (rm -> memory);
-   
+
    mpz_set_ui ((rm -> instructions_done), 0);
    mpz_set_ui ((rm -> time_consumed), 0);
 
@@ -1,3 +1,6 @@
+#ifndef RAM_H
+#define RAM_H
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <gmp.h>
@@ -19,13 +22,21 @@ typedef enum
 }
 RAM_InstructionType;
 
+extern const char *ram_instruction_names [];
+
 typedef enum
 {
    RAM_NO_PARAMETER, RAM_CONSTANT, RAM_POINTER, RAM_INDIRECT_POINTER,
-   RAM_INSTRUCTION
+   RAM_INSTRUCTION, RAM_TAPE
 }
 RAM_ParameterType;
 
+typedef enum
+{
+   RAM_TAPE_TEXT, RAM_TAPE_BINARY
+}
+RAM_TapeEncoding;
+
 typedef struct
 {
    RAM_InstructionType instruction;
@@ -34,20 +45,72 @@ typedef struct
 }
 RAM_Instruction;
 
+typedef struct
+{
+   char *name;
+   unsigned int instruction;
+}
+RAM_Label;
+
 typedef struct
 {
    RAM_Instruction **instructions;
    unsigned int n;
+
+   char **tape_names;
+   unsigned int tape_count;
+
+   unsigned int *lines;
+   unsigned int lines_size;
+   RAM_Label *labels;
+   unsigned int label_count;
+
+   unsigned long (*native) (struct _RAM *, unsigned long steps);
+
+   void *mapping;
+   size_t mapping_size;
 }
 RAM_Program;
 
+typedef struct _RAM_Ring RAM_Ring;
+
 typedef struct
+{
+   unsigned long generation;
+   RAM_AVL_Node *node;
+   unsigned long base, index;
+   mpz_t *pointer, *target;
+}
+RAM_OperandCache;
+
+typedef struct
+{
+   const char *name;
+   FILE *file;
+   RAM_TapeEncoding encoding;
+   RAM_Ring *ring;
+}
+RAM_Tape;
+
+typedef struct _RAM
 {
    RAM_Program *program;
 
    FILE *input, *output;
+   RAM_TapeEncoding encoding;
+   RAM_Ring *input_ring, *output_ring;
+   RAM_Ring *waiting;
+   int waiting_for_write;
+
+   RAM_Tape *tapes;
+   unsigned int tape_count;
 
    RAM_Memory *memory;
+   RAM_OperandCache *operands;
+
+   mpz_t *accumulator;
+   RAM_Memory *accumulator_memory;
+   unsigned long accumulator_generation;
 
    unsigned int current_instruction;
    
@@ -61,6 +124,15 @@ void ram_instruction_delete (RAM_Instruction *);
 
 RAM_Program *ram_program_new ();
 void ram_program_delete (RAM_Program *);
+void ram_program_unshare (RAM_Program *);
+unsigned long ram_program_hash (RAM_Program *);
+
+void ram_program_set_line (RAM_Program *, unsigned int instruction,
+				unsigned int line);
+void ram_program_add_label (RAM_Program *, const char *name,
+				unsigned int instruction);
+unsigned int ram_program_find_label (RAM_Program *, const char *name);
+unsigned int ram_program_find_line (RAM_Program *, unsigned int line);
 
 RAM *ram_new ();
 
@@ -70,9 +142,24 @@ void ram_delete (RAM *);
 void ram_reset (RAM *);
 
 RAM_Program *ram_program_parse (FILE *f, RAM_Text *text);
+RAM_Program *ram_program_parse_parallel (const char *path,
+				unsigned int threads);
 RAM *ram_new_by_program (RAM_Program *);
 
+unsigned int ram_program_add_tape (RAM_Program *, const char *name);
+int ram_tape_bind (RAM *, const char *name, FILE *, RAM_TapeEncoding);
+RAM_Tape *ram_instruction_tape (RAM *, RAM_Instruction *);
+int ram_tape_read (FILE *, RAM_TapeEncoding, mpz_t);
+int ram_tape_write (FILE *, RAM_TapeEncoding, mpz_t);
+
 
 
 int ram_do_instruction (RAM *);
-inline int ram_is_running (RAM *);
+unsigned long ram_run (RAM *, unsigned long steps);
+int ram_step (RAM *);
+mpz_t *ram_accumulator (RAM *);
+void ram_accumulator_add (mpz_t accumulator, mpz_t n);
+void ram_accumulator_half (mpz_t accumulator);
+int ram_is_running (RAM *);
+
+#endif
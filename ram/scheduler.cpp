@@ -0,0 +1,153 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <gmp.h>
+#include "scheduler.h"
+#include "pipeline.h"
+
+/* Stride scheduling: every task advances its pass by its stride for
+   each step it runs, and the ready task with the lowest pass runs next
+   for up to one quantum.  Ties go to the task added first, so a run is
+   deterministic for a given set of machines and inputs.  Tasks waiting
+   on a ring are skipped until the ring can make progress, and rejoin at
+   the current pass instead of catching up on the time they slept. */
+
+static const unsigned long STRIDE_ONE = 1UL << 20;
+
+RAM_Scheduler *ram_scheduler_new (unsigned long quantum)
+{
+   RAM_Scheduler *scheduler;
+
+   scheduler = (RAM_Scheduler *) calloc (1, sizeof (RAM_Scheduler));
+   if (!scheduler)
+      err_fatal_perror ("calloc",
+		      "could not allocate RAM_Scheduler structure");
+
+   (scheduler -> quantum) = quantum ? quantum : 1;
+
+   return scheduler;
+}
+
+void ram_scheduler_delete (RAM_Scheduler *scheduler)
+{
+   free (scheduler -> tasks);
+   free (scheduler);
+}
+
+unsigned int ram_scheduler_add (RAM_Scheduler *scheduler, RAM *machine,
+				unsigned int priority)
+{
+   RAM_Task *task;
+
+   if ((scheduler -> n) == (scheduler -> size))
+   {
+      (scheduler -> size) = (scheduler -> size) ? 2 * (scheduler -> size) : 8;
+      (scheduler -> tasks) = (RAM_Task *) realloc ((scheduler -> tasks),
+		      (scheduler -> size) * sizeof (RAM_Task));
+      if (!(scheduler -> tasks))
+	 err_fatal_perror ("realloc", "could not allocate %u tasks",
+			 (scheduler -> size));
+   }
+
+   task = (scheduler -> tasks) + (scheduler -> n);
+   (task -> machine) = machine;
+   (task -> state) = RAM_TASK_READY;
+   (task -> pass) = (scheduler -> pass);
+   (task -> steps) = 0;
+   (task -> slices) = 0;
+   ram_scheduler_set_priority (scheduler, (scheduler -> n), priority);
+
+   return (scheduler -> n) ++;
+}
+
+void ram_scheduler_set_priority (RAM_Scheduler *scheduler,
+				unsigned int task, unsigned int priority)
+{
+   RAM_Task *t = (scheduler -> tasks) + task;
+
+   (t -> priority) = priority ? priority : 1;
+   (t -> stride) = STRIDE_ONE / (t -> priority);
+}
+
+static void wake_tasks (RAM_Scheduler *scheduler)
+{
+   unsigned int i;
+
+   for (i = 0; i < (scheduler -> n); i ++)
+   {
+      RAM_Task *task = (scheduler -> tasks) + i;
+
+      if ((task -> state) == RAM_TASK_BLOCKED &&
+	  ram_ring_ready ((task -> machine -> waiting),
+			  (task -> machine -> waiting_for_write)))
+      {
+	 (task -> state) = RAM_TASK_READY;
+	 if ((task -> pass) < (scheduler -> pass))
+	    (task -> pass) = (scheduler -> pass);
+      }
+   }
+}
+
+static RAM_Task *next_task (RAM_Scheduler *scheduler)
+{
+   RAM_Task *best = NULL;
+   unsigned int i;
+
+   for (i = 0; i < (scheduler -> n); i ++)
+   {
+      RAM_Task *task = (scheduler -> tasks) + i;
+
+      if ((task -> state) == RAM_TASK_READY &&
+	  (!best || (task -> pass) < (best -> pass)))
+	 best = task;
+   }
+
+   return best;
+}
+
+int ram_scheduler_step (RAM_Scheduler *scheduler)
+{
+   RAM_Task *task;
+   RAM *machine;
+   unsigned long done;
+
+   wake_tasks (scheduler);
+
+   task = next_task (scheduler);
+   if (!task)
+      return 0;
+
+   machine = (task -> machine);
+   (scheduler -> pass) = (task -> pass);
+
+   done = ram_run (machine, (scheduler -> quantum));
+
+   (task -> steps) += done;
+   (task -> slices) ++;
+   (task -> pass) += (task -> stride) * (done ? done : 1);
+
+   if (done < (scheduler -> quantum))
+   {
+      if (machine -> waiting)
+	 (task -> state) = RAM_TASK_BLOCKED;
+      else
+      {
+	 (task -> state) = RAM_TASK_DONE;
+	 ram_ring_release (machine);
+      }
+   }
+
+   return 1;
+}
+
+unsigned int ram_scheduler_run (RAM_Scheduler *scheduler)
+{
+   unsigned int i, left = 0;
+
+   while (ram_scheduler_step (scheduler));
+
+   for (i = 0; i < (scheduler -> n); i ++)
+      if ((scheduler -> tasks) [i].state != RAM_TASK_DONE)
+	 left ++;
+
+   return left;
+}
@@ -0,0 +1,47 @@
+#ifndef RAM_SCHEDULER_H
+#define RAM_SCHEDULER_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "ram.h"
+
+
+typedef enum
+{
+   RAM_TASK_READY, RAM_TASK_BLOCKED, RAM_TASK_DONE
+}
+RAM_TaskState;
+
+typedef struct
+{
+   RAM *machine;
+   RAM_TaskState state;
+
+   unsigned int priority;
+   unsigned long stride, pass;
+   unsigned long steps, slices;
+}
+RAM_Task;
+
+typedef struct
+{
+   RAM_Task *tasks;
+   unsigned int n, size;
+
+   unsigned long quantum;
+   unsigned long pass;
+}
+RAM_Scheduler;
+
+RAM_Scheduler *ram_scheduler_new (unsigned long quantum);
+void ram_scheduler_delete (RAM_Scheduler *);
+
+unsigned int ram_scheduler_add (RAM_Scheduler *, RAM *,
+				unsigned int priority);
+void ram_scheduler_set_priority (RAM_Scheduler *, unsigned int task,
+				unsigned int priority);
+
+int ram_scheduler_step (RAM_Scheduler *);
+unsigned int ram_scheduler_run (RAM_Scheduler *);
+
+#endif
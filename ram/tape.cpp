@@ -0,0 +1,190 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <limits.h>
+#include <string.h>
+#include <gmp.h>
+#include "ram.h"
+
+/* Binary tapes hold each value as a signed 64-bit little endian word
+   count (negative for negative values) followed by that many 64-bit
+   little endian words, least significant first, i.e. the layout of
+   mpz_export (..., -1, 8, -1, 0, ...). */
+
+static const unsigned long CHUNK_WORDS = 4096;
+
+unsigned int ram_program_add_tape (RAM_Program *rp, const char *name)
+{
+   unsigned int i;
+
+   for (i = 0; i < (rp -> tape_count); i ++)
+      if (!strcmp ((rp -> tape_names) [i], name))
+	 return i + 1;
+
+   ram_program_unshare (rp);
+
+   (rp -> tape_names) = (char **) realloc ((rp -> tape_names),
+		   ((rp -> tape_count) + 1) * sizeof (char *));
+   if (!(rp -> tape_names))
+      err_fatal_perror ("realloc", "could not add tape %s", name);
+
+   (rp -> tape_names) [rp -> tape_count] = strdup (name);
+
+   return ++ (rp -> tape_count);
+}
+
+int ram_tape_bind (RAM *machine, const char *name, FILE *file,
+				RAM_TapeEncoding encoding)
+{
+   unsigned int i;
+
+   for (i = 0; i < (machine -> tape_count); i ++)
+      if (!strcmp ((machine -> tapes) [i].name, name))
+      {
+	 (machine -> tapes) [i].file = file;
+	 (machine -> tapes) [i].encoding = encoding;
+	 return 1;
+      }
+
+   return 0;
+}
+
+RAM_Tape *ram_instruction_tape (RAM *machine, RAM_Instruction *i)
+{
+   if ((i -> parameter_type) != RAM_TAPE)
+      return NULL;
+
+   return (machine -> tapes) + mpz_get_ui (i -> parameter) - 1;
+}
+
+static int read_word (FILE *f, unsigned long *v)
+{
+   unsigned char buf [8];
+   int i;
+
+   if (fread (buf, 1, 8, f) != 8)
+      return 0;
+
+   (*v) = 0;
+   for (i = 0; i < 8; i ++)
+      (*v) |= ((unsigned long) buf [i]) << (8 * i);
+
+   return 1;
+}
+
+static int write_word (FILE *f, unsigned long v)
+{
+   unsigned char buf [8];
+   int i;
+
+   for (i = 0; i < 8; i ++)
+      buf [i] = (v >> (8 * i)) & 0xff;
+
+   return fwrite (buf, 1, 8, f) == 8;
+}
+
+/* The words are read in chunks into a buffer that grows with what has
+   arrived, so a corrupt count fails at the end of the tape rather than
+   allocating for it up front. */
+static int read_words (FILE *f, unsigned long count, mpz_t v)
+{
+   unsigned char *words = NULL, *bigger;
+   unsigned long have = 0, room = 0, chunk;
+   int ok = 0;
+
+   while (have < count)
+   {
+      chunk = (count - have < CHUNK_WORDS) ? count - have : CHUNK_WORDS;
+
+      if (have + chunk > room)
+      {
+	 room = (2 * room > have + chunk) ? 2 * room : have + chunk;
+	 if (room > count)
+	    room = count;
+
+	 bigger = (unsigned char *) realloc (words, room * 8);
+	 if (!bigger)
+	    goto out;
+	 words = bigger;
+      }
+
+      if (fread (words + 8 * have, 8, chunk, f) != chunk)
+	 goto out;
+      have += chunk;
+   }
+
+   mpz_import (v, count, -1, 8, -1, 0, words);
+   ok = 1;
+
+out:
+   free (words);
+   return ok;
+}
+
+int ram_tape_read (FILE *f, RAM_TapeEncoding encoding, mpz_t v)
+{
+   if (encoding == RAM_TAPE_BINARY)
+   {
+      unsigned long header;
+      long count;
+
+      if (!read_word (f, &header))
+	 return 0;
+
+      count = (long) header;
+      if (count == LONG_MIN || labs (count) > LONG_MAX / 8)
+	 return 0;
+      if (count == 0)
+      {
+	 mpz_set_ui (v, 0);
+	 return 1;
+      }
+
+      if (!read_words (f, labs (count), v))
+	 return 0;
+      if (count < 0)
+	 mpz_neg (v, v);
+
+      return 1;
+   }
+   else
+   {
+      char *line = read_line (f);
+      int ok;
+
+      if (!line)
+	 return 0;
+
+      ok = !mpz_set_str (v, line, 10);
+      free (line);
+
+      return ok;
+   }
+}
+
+int ram_tape_write (FILE *f, RAM_TapeEncoding encoding, mpz_t v)
+{
+   if (encoding == RAM_TAPE_BINARY)
+   {
+      size_t count;
+      void *words;
+      int ok;
+
+      words = mpz_export (NULL, &count, -1, 8, -1, 0, v);
+
+      ok = write_word (f, (mpz_sgn (v) < 0) ? - (long) count : (long) count);
+      if (ok && count)
+	 ok = fwrite (words, 8, count, f) == count;
+
+      if (words)
+      {
+	 void (*free_function) (void *, size_t);
+
+	 mp_get_memory_functions (NULL, NULL, &free_function);
+	 free_function (words, count * 8);
+      }
+
+      return ok;
+   }
+
+   return mpz_out_str (f, 10, v) && fputc ('\n', f) != EOF;
+}
@@ -0,0 +1,131 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <dlfcn.h>
+#include <gmp.h>
+#include "compiler.h"
+#include "fuzz.h"
+
+/* Compiles fuzzer programs to native code, loads each one and checks it
+   against the interpreter with ram_fuzz_compare_batches: current
+   instruction, counters, registers and output must match exactly.  Each
+   program is run one step per call, then with budgets of 7 and 1000
+   steps and in one call to the end, so that the jumps between the
+   generated instructions are taken as well as the budget exits.  The
+   loaded code calls back into the RAM API, so the test is linked with
+   -rdynamic, e.g. from the ram directory:
+
+      c++ -I. -rdynamic tests/compiler_test.cpp <ram sources> -lgmp -ldl
+
+   RAM_CXX names the compiler used for the generated files (c++ by
+   default) and RAM_INCLUDE the directory holding ram.h (the current
+   one by default).  The first argument is the seed of the first
+   program, the second the number of programs. */
+
+static const unsigned long MAX_STEPS = 4096;
+
+static const unsigned long BATCHES [] = { 1, 7, 1000, MAX_STEPS };
+
+static int build (const char *dir, unsigned long seed, RAM_Program *program,
+		  void **library)
+{
+   const char *cxx = getenv ("RAM_CXX"), *include = getenv ("RAM_INCLUDE");
+   char name [64], source [4096], object [4096], command [16384];
+   int (*install) (RAM_Program *);
+   FILE *out;
+
+   snprintf (name, sizeof (name), "program_%lx", seed);
+   snprintf (source, sizeof (source), "%s/%s.cpp", dir, name);
+   snprintf (object, sizeof (object), "%s/%s.so", dir, name);
+
+   out = fopen (source, "w");
+   if (!out)
+   {
+      perror (source);
+      return 0;
+   }
+
+   if (!ram_program_compile (program, out, name))
+   {
+      fprintf (stderr, "%s: could not write the generated code\n", source);
+      fclose (out);
+      return 0;
+   }
+   fclose (out);
+
+   snprintf (command, sizeof (command), "%s -shared -fPIC -O1 -I'%s' "
+		   "-o '%s' '%s'", cxx ? cxx : "c++", include ? include : ".",
+		   object, source);
+   if (system (command))
+   {
+      fprintf (stderr, "%s: does not build\n", source);
+      return 0;
+   }
+
+   (*library) = dlopen (object, RTLD_NOW);
+   if (!(*library))
+   {
+      fprintf (stderr, "%s\n", dlerror ());
+      return 0;
+   }
+
+   strcat (name, "_install");
+   install = (int (*) (RAM_Program *)) dlsym ((*library), name);
+   if (!install || !install (program) || !(program -> native))
+   {
+      fprintf (stderr, "%s: does not install\n", object);
+      return 0;
+   }
+
+   unlink (source);
+   unlink (object);
+
+   return 1;
+}
+
+int main (int argc, char **argv)
+{
+   const RAM_Engine *reference = ram_engine_find ("reference"),
+		    *run = ram_engine_find ("run");
+   unsigned long seed = argc > 1 ? strtoul (argv [1], NULL, 0) : 1,
+		 programs = argc > 2 ? strtoul (argv [2], NULL, 0) : 16, k;
+   char dir [] = "/tmp/ram_compiler_testXXXXXX";
+   RAM_FuzzStats stats;
+   int failed = 0;
+
+   if (!mkdtemp (dir))
+   {
+      perror (dir);
+      return 1;
+   }
+
+   memset (&stats, 0, sizeof (stats));
+
+   for (k = 0; k < programs && !failed; k ++)
+   {
+      RAM_Program *program = ram_fuzz_program (seed + k);
+      void *library = NULL;
+      unsigned int b;
+
+      if (!build (dir, seed + k, program, &library))
+	 failed = 1;
+
+      for (b = 0; !failed && b < sizeof (BATCHES) / sizeof (BATCHES [0]);
+	   b ++)
+	 if (ram_fuzz_compare_batches (program, seed + k, reference, run,
+				 BATCHES [b], MAX_STEPS, stderr, &stats))
+	    failed = 1;
+
+      ram_program_delete (program);
+      if (library)
+	 dlclose (library);
+   }
+
+   rmdir (dir);
+
+   printf ("%lu programs, %lu steps, %lu divergences\n", (stats.programs),
+		   (stats.steps), (stats.divergences));
+
+   return failed;
+}
@@ -0,0 +1,52 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <gmp.h>
+#include "fuzz.h"
+
+/* Runs every fuzzer program of a fixed seed range on each engine that is
+   not the reference one (plain ram_run, the B-tree and the compacting
+   memory) and checks it step by step against the reference interpreter
+   with ram_fuzz.  Any divergence is reported on stderr and fails the
+   test.  Build it from the ram directory, e.g.:
+
+      c++ -I. tests/fuzz_test.cpp <ram sources> -lgmp
+
+   The first argument is the seed of the first program, the second the
+   number of programs per engine. */
+
+static const unsigned long MAX_STEPS = 5000;
+
+static const char *ENGINES [] = { "run", "btree", "compacting" };
+
+int main (int argc, char **argv)
+{
+   const RAM_Engine *reference = ram_engine_find ("reference");
+   unsigned long seed = argc > 1 ? strtoul (argv [1], NULL, 0) : 12345,
+		 programs = argc > 2 ? strtoul (argv [2], NULL, 0) : 500;
+   RAM_FuzzStats stats;
+   unsigned int e;
+   int failed = 0;
+
+   for (e = 0; e < sizeof (ENGINES) / sizeof (ENGINES [0]); e ++)
+   {
+      const RAM_Engine *candidate = ram_engine_find (ENGINES [e]);
+
+      if (!candidate)
+      {
+	 fprintf (stderr, "%s: no such engine\n", ENGINES [e]);
+	 failed = 1;
+	 continue;
+      }
+
+      if (ram_fuzz (reference, candidate, seed, programs, MAX_STEPS, stderr,
+		    &stats))
+	 failed = 1;
+
+      printf ("%s: %lu programs, %lu steps, %lu divergences\n",
+		      ENGINES [e], (stats.programs), (stats.steps),
+		      (stats.divergences));
+   }
+
+   return failed;
+}
@@ -0,0 +1,116 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <gmp.h>
+#include "usage.h"
+#include "arena.h"
+
+
+static const char *category_names [] =
+{
+   "tree nodes", "register segments", "gmp limbs"
+};
+
+static long live [RAM_USAGE_CATEGORIES], peak [RAM_USAGE_CATEGORIES];
+static long total_live, total_peak;
+
+static inline void raise_peak (long *peak_value, long value)
+{
+   long old = __atomic_load_n (peak_value, __ATOMIC_RELAXED);
+
+   while (value > old)
+      if (__atomic_compare_exchange_n (peak_value, &old, value, 1,
+			      __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+	 break;
+}
+
+void ram_usage_add (RAM_UsageCategory category, long bytes)
+{
+   long category_live, all_live;
+
+   category_live = __atomic_add_fetch (&(live [category]), bytes,
+		   			__ATOMIC_RELAXED);
+   all_live = __atomic_add_fetch (&total_live, bytes, __ATOMIC_RELAXED);
+
+   if (bytes > 0)
+   {
+      raise_peak (&(peak [category]), category_live);
+      raise_peak (&total_peak, all_live);
+   }
+}
+
+void ram_usage_get (RAM_Usage *usage)
+{
+   int i;
+
+   for (i = 0; i < RAM_USAGE_CATEGORIES; i ++)
+   {
+      (usage -> live) [i] = __atomic_load_n (&(live [i]), __ATOMIC_RELAXED);
+      (usage -> peak) [i] = __atomic_load_n (&(peak [i]), __ATOMIC_RELAXED);
+   }
+
+   (usage -> total_live) = __atomic_load_n (&total_live, __ATOMIC_RELAXED);
+   (usage -> total_peak) = __atomic_load_n (&total_peak, __ATOMIC_RELAXED);
+}
+
+void ram_usage_reset_peak ()
+{
+   int i;
+
+   for (i = 0; i < RAM_USAGE_CATEGORIES; i ++)
+      __atomic_store_n (&(peak [i]),
+		      __atomic_load_n (&(live [i]), __ATOMIC_RELAXED),
+		      __ATOMIC_RELAXED);
+
+   __atomic_store_n (&total_peak,
+		   __atomic_load_n (&total_live, __ATOMIC_RELAXED),
+		   __ATOMIC_RELAXED);
+}
+
+
+static void *gmp_allocate (size_t size)
+{
+   void *p = ram_arena_allocate (size);
+
+   ram_usage_add (RAM_USAGE_LIMBS, (long) size);
+
+   return p;
+}
+
+static void *gmp_reallocate (void *p, size_t old_size, size_t new_size)
+{
+   p = ram_arena_reallocate (p, old_size, new_size);
+
+   ram_usage_add (RAM_USAGE_LIMBS, (long) new_size - (long) old_size);
+
+   return p;
+}
+
+static void gmp_free (void *p, size_t size)
+{
+   ram_arena_free (p, size);
+
+   ram_usage_add (RAM_USAGE_LIMBS, - (long) size);
+}
+
+/* Must be called before the first GMP allocation: the hooks expect every
+   block they release to carry an arena header. */
+void ram_usage_install_gmp_hooks ()
+{
+   mp_set_memory_functions (gmp_allocate, gmp_reallocate, gmp_free);
+}
+
+
+void ram_usage_print (FILE *f)
+{
+   RAM_Usage usage;
+   int i;
+
+   ram_usage_get (&usage);
+
+   fprintf (f, "  %-20s %12s %14s\n", "memory usage", "live", "peak");
+   for (i = 0; i < RAM_USAGE_CATEGORIES; i ++)
+      fprintf (f, "  %-20s %12ld %14ld\n", category_names [i],
+		      (usage.live) [i], (usage.peak) [i]);
+   fprintf (f, "  %-20s %12ld %14ld\n", "total",
+		   (usage.total_live), (usage.total_peak));
+}
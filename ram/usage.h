@@ -0,0 +1,33 @@
+#ifndef RAM_USAGE_H
+#define RAM_USAGE_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <gmp.h>
+
+
+typedef enum
+{
+   RAM_USAGE_NODES = 0,
+   RAM_USAGE_SEGMENTS,
+   RAM_USAGE_LIMBS,
+   RAM_USAGE_CATEGORIES
+}
+RAM_UsageCategory;
+
+typedef struct
+{
+   long live [RAM_USAGE_CATEGORIES], peak [RAM_USAGE_CATEGORIES];
+   long total_live, total_peak;
+}
+RAM_Usage;
+
+void ram_usage_add (RAM_UsageCategory, long bytes);
+void ram_usage_get (RAM_Usage *);
+void ram_usage_reset_peak ();
+
+void ram_usage_install_gmp_hooks ();
+
+void ram_usage_print (FILE *);
+
+#endif